@@ -0,0 +1,150 @@
+/*
+ * arena.c - per-connection bump allocator
+ *
+ * The chunk in use is at the head of a list of the ones filled before it.
+ * A request that does not fit in what is left of it gets a new chunk at
+ * least twice as big, so an arena that keeps growing makes few malloc()
+ * calls; arena_reset() replaces a list of more than one with a single
+ * chunk of their combined size.
+ *
+ * The totals are shared by every thread. Only growing, closing and a new
+ * high-water mark of some arena write to them, never an ordinary
+ * allocation or reset, so workers do not fight over their cache line.
+ */
+
+#include "arena.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct arena_chunk {
+    arena_chunk *prev;
+    size_t size;
+};
+
+/* the data follows the header, rounded up so that it stays aligned */
+#define CHUNK_HEAD                                                          \
+    ((sizeof(arena_chunk) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEAD)
+
+/* a new arena's first chunk, until connections have told us better */
+#define ARENA_FIRST_CHUNK (16 * ARENA_MIN_CHUNK)
+
+static arena_stats totals = {0, ARENA_FIRST_CHUNK, 0, 0};
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+static void note_high(size_t high)
+{
+    size_t seen = __atomic_load_n(&totals.high, __ATOMIC_RELAXED);
+    while (high > seen
+           && !__atomic_compare_exchange_n(&totals.high, &seen, high, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static bool add_chunk(arena *a, size_t size)
+{
+    arena_chunk *c;
+
+    size = round_up(size, ARENA_MIN_CHUNK);
+    if ((c = malloc(CHUNK_HEAD + size)) == NULL) {
+        return false;
+    }
+    c->prev = a->chunk;
+    c->size = size;
+    a->chunk = c;
+    a->off = 0;
+    a->size += size;
+    __atomic_fetch_add(&totals.chunks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totals.reserved, size, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void free_chunks(arena *a)
+{
+    while (a->chunk != NULL) {
+        arena_chunk *c = a->chunk;
+        a->chunk = c->prev;
+        free(c);
+    }
+    __atomic_fetch_sub(&totals.reserved, a->size, __ATOMIC_RELAXED);
+    a->size = 0;
+    a->off = 0;
+}
+
+void arena_init(arena *a)
+{
+    a->chunk = NULL;
+    a->off = a->size = a->used = a->high = 0;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = round_up(size > 0 ? size : 1, ARENA_ALIGN);
+    if (a->chunk == NULL || a->chunk->size - a->off < size) {
+        size_t want = a->chunk != NULL
+                          ? 2 * a->chunk->size
+                          : __atomic_load_n(&totals.hint, __ATOMIC_RELAXED);
+        if (!add_chunk(a, want > size ? want : size)) {
+            return NULL;
+        }
+    }
+    void *p = CHUNK_DATA(a->chunk) + a->off;
+    a->off += size;
+    a->used += size;
+    if (a->used > a->high) {
+        a->high = a->used;
+        note_high(a->high); /* rare: an arena's mark only goes up */
+    }
+    return p;
+}
+
+char *arena_strndup(arena *a, const char *s, size_t n)
+{
+    char *copy = arena_alloc(a, n + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, n);
+        copy[n] = '\0';
+    }
+    return copy;
+}
+
+void arena_reset(arena *a)
+{
+    if (a->chunk != NULL && a->chunk->prev != NULL) {
+        size_t size = a->size;
+        free_chunks(a);
+        add_chunk(a, size); /* on failure the next allocation tries again */
+    }
+    a->off = 0;
+    a->used = 0;
+}
+
+void arena_free(arena *a)
+{
+    if (a->high > 0) {
+        /* new arenas start a quarter of the way from the old size to what
+        this one needed: a few large connections do not make every later
+        one start large */
+        size_t hint = __atomic_load_n(&totals.hint, __ATOMIC_RELAXED);
+        size_t need = round_up(a->high, ARENA_MIN_CHUNK);
+        hint = need > hint ? hint + (need - hint) / 4 : hint - (hint - need) / 4;
+        __atomic_store_n(&totals.hint, round_up(hint, ARENA_MIN_CHUNK),
+                         __ATOMIC_RELAXED);
+    }
+    free_chunks(a);
+    arena_init(a);
+}
+
+void arena_stats_read(arena_stats *st)
+{
+    st->high = __atomic_load_n(&totals.high, __ATOMIC_RELAXED);
+    st->hint = __atomic_load_n(&totals.hint, __ATOMIC_RELAXED);
+    st->reserved = __atomic_load_n(&totals.reserved, __ATOMIC_RELAXED);
+    st->chunks = __atomic_load_n(&totals.chunks, __ATOMIC_RELAXED);
+}
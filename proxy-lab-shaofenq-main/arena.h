@@ -0,0 +1,67 @@
+/**
+ * @file arena.h
+ * @brief Bump allocator for what a connection's requests need while they
+ * are being served
+ *
+ * A request needs the same handful of things every time: a table for its
+ * headers, its host and cache key as strings, the iovecs of the request
+ * that goes to the origin and a buffer for its head and relay data. Each
+ * connection (each worker thread, in the threaded model) owns an arena
+ * they all come from. Allocating is moving a pointer; nothing is freed on
+ * its own, the arena is reset once the requests using it are done and
+ * hands out the same memory again.
+ *
+ * Chunks are malloc()ed only while an arena grows. The reset after growing
+ * folds its chunks into one that holds all of it, so once a connection has
+ * seen a request of its usual size the requests after it allocate nothing
+ * from the heap. A new arena's first chunk is sized from what connections
+ * closed recently needed.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16     /* every allocation starts on a multiple of this */
+#define ARENA_MIN_CHUNK 1024 /* chunk sizes are multiples of this */
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct {
+    arena_chunk *chunk; /* allocations come from here; older chunks behind */
+    size_t off;         /* bytes of chunk handed out */
+    size_t size;        /* bytes in all the chunks */
+    size_t used;        /* bytes handed out since the last reset */
+    size_t high;        /* the most used has been: the high-water mark */
+} arena;
+
+/* arenas taken together, since the start */
+typedef struct {
+    size_t high;           /* highest high-water mark of any arena */
+    size_t hint;           /* first chunk size of a new arena */
+    size_t reserved;       /* bytes in chunks right now */
+    unsigned long chunks;  /* chunks malloc()ed */
+} arena_stats;
+
+/* An empty arena; nothing is allocated until it is first used */
+void arena_init(arena *a);
+
+/* size bytes, aligned to ARENA_ALIGN and valid until the next reset, or
+NULL if a chunk was needed and malloc() failed */
+void *arena_alloc(arena *a, size_t size);
+
+/* The n bytes at s as a NUL-terminated copy in a, or NULL */
+char *arena_strndup(arena *a, const char *s, size_t n);
+
+/* Take back everything handed out; the chunks are kept (as one) */
+void arena_reset(arena *a);
+
+/* Give the chunks back to malloc(); the arena is empty again after this */
+void arena_free(arena *a);
+
+/* Read the totals; they are updated without locks, so a snapshot taken
+while other threads allocate may be slightly behind */
+void arena_stats_read(arena_stats *st);
+
+#endif /* ARENA_H */
@@ -3,6 +3,1393 @@ author: Shaofeng Qin, shaofenq
 Main goal: this cache aims to store the url and server's reply in cache blocks such that
 when client request some already existed url(key) in the cache, instead of retrieving from server(takes longer time)
 cache will direcly send the saved reply from server to the client, which has higher efficiency
+
+How it is organized:
+  - the key's hash picks one of CACHE_SHARDS shards, each with its own
+    reader-writer lock, hash table and the eviction policy's lists
+  - a hit is a bucket walk under the shard lock held in shared mode. It only
+    writes the block's policy counters and reference count, all atomically,
+    so any number of hits run in parallel, even on the same shard
+  - blocks are immutable once inserted and reference counted. A reader takes
+    a reference under the shared lock and writes the data out after dropping
+    it; an evicted block is reclaimed when the last reader releases it
+  - the eviction policy is picked at startup (cache_policy): LRU, S3-FIFO
+    or GDSF. LRU's list is kept sorted by "placed", and the order is fixed
+    up lazily on the writer path: a block found at the tail with a stamp
+    newer than when it was placed has been hit since, so it is moved to the
+    spot its new stamp sorts to and the next tail is checked. The first
+    untouched tail is then the shard's least recently used block, and the
+    oldest of those over all shards is evicted. GDSF ranks by frequency over
+    size the same way; S3-FIFO only moves blocks when it evicts
+  - optionally, misses are coalesced: the first miss on a key registers a
+    cache_fill, and later misses on that key sleep on it until the fetch is
+    inserted or abandoned, then look the key up again
+  - inserts and evictions are serialized by writer_lock, which also guards
+    the byte count and the policies' lists: hits never walk those, so
+    picking a victim takes no shard lock, and a shard is locked exclusively
+    only to link or unlink a block from its hash chains. The locks prefer
+    writers so a stream of hits cannot starve an insert
+  - optionally (TinyLFU), every lookup is counted in a count-min sketch, and
+    a new object that needs room is only let in if it has been asked for
+    more often than the block it would evict. A scan of objects asked for
+    once then cannot push out the ones asked for all the time. The counters
+    are halved every SKETCH_SAMPLE lookups so old popularity fades
+  - optionally (-D), every response cached is also written to the disk
+    tier (disk.c), by its background thread, which holds a reference to
+    the block until then. A lookup that misses here asks the disk before
+    giving up, and an object found there is linked back in like a fresh
+    insert
+  - cache_snapshot() writes the whole cache to one file in eviction order,
+    and cache_restore() maps it back in while the proxy serves: the
+    restored blocks keep pointing into the mapping (block->mapped)
+  - a block's freshness (Cache-Control max-age from its Date) and its
+    validators are read from the stored headers when it is made. The only
+    thing about a block that changes after that is when it expires: a 304
+    to a revalidation stores a new time, and a response fetched because a
+    block went stale replaces it on insert
 */
 
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np */
+
+#include "cache.h"
+#include "disk.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct cache_shard
+{
+    pthread_rwlock_t lock;
+    cache_block *buckets[CACHE_BUCKETS];
+    /* sentinels of the eviction policy's lists: next is the front, prev
+    the tail. LRU and GDSF keep one, S3-FIFO its main and small queues */
+    cache_block order[2];
+    unsigned int counted; /* lookups counted here, not yet in sketch_adds */
+} cache_shard;
+
+struct cache_fill
+{
+    char *key;
+    unsigned int hash;
+    bool done;
+    int waiters;
+    pthread_cond_t cond;
+    struct cache_fill *next;
+};
+
+static cache_shard shards[CACHE_SHARDS];
+
+/* fetches in flight, all guarded by fill_lock */
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_fill *fills[CACHE_BUCKETS];
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_used;  /* bytes of data currently linked in */
+/* counts for cache_stats_read(); all but the last two under writer_lock */
+static unsigned long cache_objects, evictions, admitted, rejected;
+static unsigned long revalidations, revalidated_bytes; /* 304s, atomically */
+
+/* the frequency sketch for TinyLFU admission: SKETCH_DEPTH rows of 4-bit
+counters (kept in bytes) indexed by different hashes of the key. A key's
+estimate is its smallest counter, which collisions can only make too big.
+Counters are read and written with relaxed atomics and no lock: a count
+lost to a race only makes an estimate slightly low */
+#define SKETCH_DEPTH 4
+#define SKETCH_BITS 10
+#define SKETCH_WIDTH (1 << SKETCH_BITS)   /* counters per row */
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH) /* lookups between two agings */
+#define SKETCH_BATCH 64 /* lookups a shard counts before adding them up */
+
+static bool admit_by_frequency;
+static unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+static unsigned long sketch_adds; /* lookups counted, in SKETCH_BATCHes */
+static unsigned long sketch_agings; /* atomically */
+
+/* a per-core clock read, unlike a shared counter it costs hits no contention */
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/* FNV-1a: cheap, and good enough to spread URIs over shards and buckets */
+unsigned int cache_hash(const char *key)
+{
+    unsigned int h = 2166136261u;
+    for (; *key; key++)
+    {
+        h ^= (unsigned char)*key;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static cache_shard *shard_of(unsigned int hash)
+{
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static cache_block **bucket_of(cache_shard *s, unsigned int hash)
+{
+    return &s->buckets[(hash / CACHE_SHARDS) & (CACHE_BUCKETS - 1)];
+}
+
+/* the key's counter in one row of the sketch: multiplicative hashing with a
+different odd constant per row, keeping the top bits */
+static unsigned char *sketch_counter(unsigned int hash, int row)
+{
+    static const uint32_t mult[SKETCH_DEPTH] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu};
+    return &sketch[row][(uint32_t)(hash * mult[row]) >> (32 - SKETCH_BITS)];
+}
+
+static unsigned int sketch_estimate(unsigned int hash)
+{
+    unsigned int min = SKETCH_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        unsigned int c = __atomic_load_n(sketch_counter(hash, row), __ATOMIC_RELAXED);
+        if (c < min)
+        {
+            min = c;
+        }
+    }
+    return min;
+}
+
+/* halve every counter, so what was popular long ago counts for less */
+static void sketch_age(void)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        for (int i = 0; i < SKETCH_WIDTH; i++)
+        {
+            unsigned char c = __atomic_load_n(&sketch[row][i], __ATOMIC_RELAXED);
+            __atomic_store_n(&sketch[row][i], c >> 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* count one lookup of the key. Only the smallest of its counters go up
+(conservative update), which keeps the others from growing with their
+collisions. The shard's own count is bumped under its lock, which the
+lookup has written anyway; the shared total is only touched once per
+SKETCH_BATCH, and the lookup that takes it past a multiple of
+SKETCH_SAMPLE ages the sketch */
+static void sketch_count(cache_shard *s, unsigned int hash)
+{
+    unsigned int min = sketch_estimate(hash);
+    if (min < SKETCH_MAX)
+    {
+        for (int row = 0; row < SKETCH_DEPTH; row++)
+        {
+            unsigned char *c = sketch_counter(hash, row);
+            if (__atomic_load_n(c, __ATOMIC_RELAXED) == min)
+            {
+                __atomic_store_n(c, min + 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (__atomic_add_fetch(&s->counted, 1, __ATOMIC_RELAXED) % SKETCH_BATCH == 0
+        && __atomic_add_fetch(&sketch_adds, SKETCH_BATCH, __ATOMIC_RELAXED)
+                   % SKETCH_SAMPLE == 0)
+    {
+        sketch_age();
+        __atomic_add_fetch(&sketch_agings, 1, __ATOMIC_RELAXED);
+    }
+}
+
+bool cache_make_key(char *key, const char *hostname, const char *port,
+                    const char *path, size_t pathlen)
+{
+    size_t i, n;
+    int len;
+
+    // hostnames are case insensitive, so fold them to one spelling
+    for (i = 0; hostname[i] != '\0' && i < CACHE_KEYLEN - 1; i++)
+    {
+        key[i] = tolower((unsigned char)hostname[i]);
+    }
+    n = i;
+    len = snprintf(key + n, CACHE_KEYLEN - n, ":%s%.*s", port, (int)pathlen, path);
+    return hostname[i] == '\0' && len >= 0 && (size_t)len < CACHE_KEYLEN - n;
+}
+
+/* caller holds the shard lock */
+static cache_block *find(cache_shard *s, const char *key, unsigned int hash)
+{
+    cache_block *b;
+    for (b = *bucket_of(s, hash); b != NULL; b = b->hnext)
+    {
+        if (b->hash == hash && !strcmp(b->key, key))
+        {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void list_unlink(cache_block *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+static void list_push_front(cache_block *list, cache_block *b)
+{
+    b->prev = list;
+    b->next = list->next;
+    list->next->prev = b;
+    list->next = b;
+}
+
+/* link b where b->placed sorts to, walking in from both ends at once so the
+cost is the distance to the nearer end */
+static void list_insert_sorted(cache_block *list, cache_block *b)
+{
+    cache_block *newer = list->next; /* walks from the front */
+    cache_block *older = list->prev; /* walks from the tail */
+    cache_block *after;
+
+    while (1)
+    {
+        if (newer == list || newer->placed <= b->placed)
+        {
+            after = newer->prev;
+            break;
+        }
+        if (older == list || older->placed >= b->placed)
+        {
+            after = older;
+            break;
+        }
+        newer = newer->next;
+        older = older->prev;
+    }
+    list_push_front(after, b);
+}
+
+/* re-sort blocks whose rank moved since they were placed, then return the
+one with the lowest rank (or NULL if the list is empty) */
+static cache_block *sorted_victim(cache_block *list,
+                                  unsigned long (*rank)(const cache_block *))
+{
+    cache_block *b;
+    while ((b = list->prev) != list)
+    {
+        unsigned long now = rank(b);
+        if (now == b->placed)
+        {
+            return b;
+        }
+        b->placed = now;
+        list_unlink(b);
+        list_insert_sorted(list, b);
+    }
+    return NULL;
+}
+
+// LRU: a block's rank is the time of its last hit
+
+static unsigned long lru_rank(const cache_block *b)
+{
+    return __atomic_load_n(&b->stamp, __ATOMIC_RELAXED);
+}
+
+static void lru_hit(cache_block *b)
+{
+    __atomic_store_n(&b->stamp, now_ns(), __ATOMIC_RELAXED);
+}
+
+static void lru_link(cache_shard *s, cache_block *b)
+{
+    b->stamp = b->placed = now_ns();
+    list_insert_sorted(&s->order[0], b);
+}
+
+static cache_block *lru_victim(cache_shard *s)
+{
+    return sorted_victim(&s->order[0], lru_rank);
+}
+
+// GDSF: rank = L + frequency / size, where L (gdsf_clock) is the rank of
+// the last victim, so a block's rank only counts its hits against what was
+// evicted since. Small objects asked for often stay; a big one has to be
+// asked for proportionally more often. Hits store the L they saw in stamp
+// and the list is re-sorted lazily, as for LRU
+
+#define GDSF_SCALE (1ul << 20) /* rank units per hit of a one-byte object */
+
+static unsigned long gdsf_clock;
+
+static unsigned long gdsf_rank(const cache_block *b)
+{
+    unsigned long freq = __atomic_load_n(&b->freq, __ATOMIC_RELAXED);
+    return __atomic_load_n(&b->stamp, __ATOMIC_RELAXED)
+           + freq * GDSF_SCALE / (b->size > 0 ? b->size : 1);
+}
+
+static void gdsf_hit(cache_block *b)
+{
+    __atomic_add_fetch(&b->freq, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->stamp, __atomic_load_n(&gdsf_clock, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+static void gdsf_link(cache_shard *s, cache_block *b)
+{
+    b->freq = 1;
+    b->stamp = gdsf_clock;
+    b->placed = gdsf_rank(b);
+    list_insert_sorted(&s->order[0], b);
+}
+
+static cache_block *gdsf_victim(cache_shard *s)
+{
+    return sorted_victim(&s->order[0], gdsf_rank);
+}
+
+static bool gdsf_evict(cache_shard *s, cache_block *b)
+{
+    (void)s;
+    __atomic_store_n(&gdsf_clock, b->placed, __ATOMIC_RELAXED);
+    return true;
+}
+
+// S3-FIFO: new blocks enter a small FIFO queue holding about a tenth of
+// the cache, and only those hit while in it move on to the main queue;
+// the rest are evicted early, so a scan passes through the small queue
+// without touching the main one. A key evicted from the small queue is
+// remembered for a while (the ghosts), and if it comes back it goes
+// straight to main. The main queue is a CLOCK: a tail with hits left is
+// put back at the front with one hit less. Hits only bump freq, up to
+// S3_FREQ_MAX; "placed" is when a block entered its queue
+
+#define S3_MAIN 0
+#define S3_SMALL 1
+#define S3_SMALL_SIZE (MAX_CACHE_SIZE / 10)
+#define S3_FREQ_MAX 3
+#define S3_GHOSTS 256 /* hashes of keys evicted from the small queue */
+
+static size_t s3_small_bytes;
+static unsigned int s3_ghost[S3_GHOSTS];
+static int s3_nghosts, s3_ghost_next;
+
+static bool s3_ghost_find(unsigned int hash)
+{
+    // linear, but only inserts look and the ring is short
+    for (int i = 0; i < s3_nghosts; i++)
+    {
+        if (s3_ghost[i] == hash)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static unsigned long s3_rank(const cache_block *b)
+{
+    return b->placed;
+}
+
+static void s3_hit(cache_block *b)
+{
+    unsigned int freq = __atomic_load_n(&b->freq, __ATOMIC_RELAXED);
+    if (freq < S3_FREQ_MAX)
+    {
+        __atomic_store_n(&b->freq, freq + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void s3_push(cache_shard *s, cache_block *b, int queue)
+{
+    b->queue = queue;
+    b->placed = now_ns();
+    list_push_front(&s->order[queue], b);
+    if (queue == S3_SMALL)
+    {
+        s3_small_bytes += b->size;
+    }
+}
+
+static void s3_link(cache_shard *s, cache_block *b)
+{
+    b->freq = 0;
+    s3_push(s, b, s3_ghost_find(b->hash) ? S3_MAIN : S3_SMALL);
+}
+
+static void s3_unlink(cache_shard *s, cache_block *b)
+{
+    (void)s;
+    list_unlink(b);
+    if (b->queue == S3_SMALL)
+    {
+        s3_small_bytes -= b->size;
+    }
+}
+
+/* the tail of the queue the cache evicts from now, or of the other one if
+this shard has nothing in that one */
+static cache_block *s3_victim(cache_shard *s)
+{
+    int queue = s3_small_bytes >= S3_SMALL_SIZE ? S3_SMALL : S3_MAIN;
+    if (s->order[queue].prev == &s->order[queue])
+    {
+        queue = !queue;
+    }
+    return s->order[queue].prev != &s->order[queue] ? s->order[queue].prev : NULL;
+}
+
+static bool s3_evict(cache_shard *s, cache_block *b)
+{
+    unsigned int freq = __atomic_load_n(&b->freq, __ATOMIC_RELAXED);
+    if (b->queue == S3_SMALL && freq == 0)
+    {
+        s3_ghost[s3_ghost_next] = b->hash;
+        s3_ghost_next = (s3_ghost_next + 1) % S3_GHOSTS;
+        if (s3_nghosts < S3_GHOSTS)
+        {
+            s3_nghosts++;
+        }
+        return true;
+    }
+    if (b->queue == S3_MAIN && freq == 0)
+    {
+        return true;
+    }
+    // promoted out of the small queue, or another lap in main
+    s3_unlink(s, b);
+    __atomic_store_n(&b->freq, b->queue == S3_SMALL ? 0 : freq - 1, __ATOMIC_RELAXED);
+    s3_push(s, b, S3_MAIN);
+    return false;
+}
+
+static void sorted_unlink(cache_shard *s, cache_block *b)
+{
+    (void)s;
+    list_unlink(b);
+}
+
+static bool always_evict(cache_shard *s, cache_block *b)
+{
+    (void)s;
+    (void)b;
+    return true;
+}
+
+/* How a policy orders the blocks. hit() runs under the shard lock held in
+shared mode, so it may only write the block's counters, atomically; the rest
+runs on the writer path, with writer_lock held, and link() and unlink() with
+the shard locked exclusively as well. victim() returns the block the shard
+would give up next, and its "placed" ranks it against the other shards' (the
+lowest goes first); evict() is asked before it goes and may keep it by
+moving it instead. rank() is where the block stands now, lowest first, for
+snapshots */
+typedef struct cache_policy
+{
+    const char *name;
+    void (*hit)(cache_block *b);
+    unsigned long (*rank)(const cache_block *b);
+    void (*link)(cache_shard *s, cache_block *b);
+    void (*unlink)(cache_shard *s, cache_block *b);
+    cache_block *(*victim)(cache_shard *s);
+    bool (*evict)(cache_shard *s, cache_block *b);
+} cache_policy;
+
+static const cache_policy policies[] = {
+    {"lru", lru_hit, lru_rank, lru_link, sorted_unlink, lru_victim, always_evict},
+    {"s3fifo", s3_hit, s3_rank, s3_link, s3_unlink, s3_victim, s3_evict},
+    {"gdsf", gdsf_hit, gdsf_rank, gdsf_link, sorted_unlink, gdsf_victim, gdsf_evict},
+};
+
+const char *const cache_policy_names[] = {"lru", "s3fifo", "gdsf", NULL};
+
+static const cache_policy *policy = &policies[0];
+
+bool cache_init(const char *policy_name, bool tinylfu)
+{
+    int p = 0;
+    while (cache_policy_names[p] != NULL && strcmp(cache_policy_names[p], policy_name))
+    {
+        p++;
+    }
+    if (cache_policy_names[p] == NULL)
+    {
+        return false;
+    }
+    policy = &policies[p];
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        cache_shard *s = &shards[i];
+        pthread_rwlock_init(&s->lock, &attr);
+        memset(s->buckets, 0, sizeof(s->buckets));
+        for (int q = 0; q < 2; q++)
+        {
+            s->order[q].next = s->order[q].prev = &s->order[q];
+        }
+        s->counted = 0;
+    }
+    pthread_rwlockattr_destroy(&attr);
+    cache_used = 0;
+    cache_objects = evictions = admitted = rejected = 0;
+    revalidations = revalidated_bytes = 0;
+    admit_by_frequency = tinylfu;
+    memset(sketch, 0, sizeof(sketch));
+    sketch_adds = sketch_agings = 0;
+    gdsf_clock = 0;
+    s3_small_bytes = 0;
+    s3_nghosts = s3_ghost_next = 0;
+    return true;
+}
+
+static void hash_unlink(cache_shard *s, cache_block *b)
+{
+    cache_block **pp = bucket_of(s, b->hash);
+    while (*pp != b)
+    {
+        pp = &(*pp)->hnext;
+    }
+    *pp = b->hnext;
+}
+
+/* take b out of its shard, whose lock the caller holds exclusively along
+with writer_lock; the cache's reference is the caller's to drop */
+static void block_unlink(cache_shard *s, cache_block *b)
+{
+    policy->unlink(s, b);
+    hash_unlink(s, b);
+    cache_used -= b->size;
+    cache_objects--;
+}
+
+static void block_free(cache_block *b)
+{
+    free(b->key);
+    if (!b->mapped)
+    {
+        free(b->data);
+    }
+    free(b);
+}
+
+/* cache_lookup(), which counts the lookup for TinyLFU if count is set */
+static cache_block *lookup(const char *key, bool count)
+{
+    unsigned int hash = cache_hash(key);
+    cache_shard *s = shard_of(hash);
+    cache_block *b;
+
+    pthread_rwlock_rdlock(&s->lock);
+    if ((b = find(s, key, hash)) != NULL)
+    {
+        policy->hit(b);
+        __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    if (count && admit_by_frequency)
+    {
+        sketch_count(s, hash);
+    }
+    pthread_rwlock_unlock(&s->lock);
+    return b;
+}
+
+void cache_retain(cache_block *block)
+{
+    __atomic_add_fetch(&block->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void cache_release(cache_block *block)
+{
+    if (__atomic_sub_fetch(&block->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        block_free(block);
+    }
+}
+
+/* the shard whose victim the policy ranks lowest, with that block's hash
+stored at hash, or NULL if the cache is empty; caller holds writer_lock,
+which is all the lists need */
+static cache_shard *oldest_shard(unsigned int *hash)
+{
+    cache_shard *victim_shard = NULL;
+    unsigned long oldest = 0;
+    cache_block *victim;
+
+    for (int i = 0; i < CACHE_SHARDS; i++)
+    {
+        cache_shard *s = &shards[i];
+        if ((victim = policy->victim(s)) != NULL
+            && (victim_shard == NULL || victim->placed < oldest))
+        {
+            victim_shard = s;
+            oldest = victim->placed;
+            *hash = victim->hash;
+        }
+    }
+    return victim_shard;
+}
+
+/* evict the block the policy gives up first, caller holds writer_lock;
+returns false if the cache is empty */
+static bool evict_one(void)
+{
+    unsigned int hash;
+    cache_shard *victim_shard;
+    cache_block *victim;
+    bool evicted;
+
+    do
+    {
+        if ((victim_shard = oldest_shard(&hash)) == NULL)
+        {
+            return false;
+        }
+
+        // a hit may have refreshed that block meanwhile; take whatever the
+        // shard gives up now, only writers remove blocks so it is not empty.
+        // The policy may keep it (second chance) and then we look again.
+        // Readers only need keeping out while it leaves its hash chain
+        victim = policy->victim(victim_shard);
+        if ((evicted = policy->evict(victim_shard, victim)))
+        {
+            pthread_rwlock_wrlock(&victim_shard->lock);
+            block_unlink(victim_shard, victim);
+            pthread_rwlock_unlock(&victim_shard->lock);
+            evictions++;
+        }
+    } while (!evicted);
+
+    cache_release(victim);
+    return true;
+}
+
+/* the value of the header name (with its colon) in the response head at
+data, len bytes or less, blanks trimmed; NULL if it has none */
+static const char *header_value(const char *data, size_t len, const char *name,
+                                size_t *value_len)
+{
+    const char *end = data + len;
+    const char *line = memchr(data, '\n', len); // after the status line
+    size_t name_len = strlen(name);
+
+    while (line != NULL && ++line < end)
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *vend = eol != NULL ? eol : end;
+        if (vend == line || (vend == line + 1 && *line == '\r'))
+        {
+            return NULL; // the blank line ends the head
+        }
+        if ((size_t)(vend - line) > name_len && !strncasecmp(line, name, name_len))
+        {
+            const char *v = line + name_len;
+            while (v < vend && (*v == ' ' || *v == '\t'))
+            {
+                v++;
+            }
+            while (vend > v && isspace((unsigned char)vend[-1]))
+            {
+                vend--;
+            }
+            *value_len = vend - v;
+            return v;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+/* the lifetime a Cache-Control value gives, in seconds: s-maxage (meant for
+shared caches such as this one) over max-age, 0 with no-cache, which asks
+for every use to be revalidated; -1 if it gives none */
+static long max_age_of(const char *value, size_t len)
+{
+    char buf[256], *token, *save;
+    long max_age = -1, s_maxage = -1;
+    bool no_cache = false;
+
+    len = len < sizeof(buf) - 1 ? len : sizeof(buf) - 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = tolower((unsigned char)value[i]);
+    }
+    buf[len] = '\0';
+    for (token = strtok_r(buf, ", \t", &save); token != NULL;
+         token = strtok_r(NULL, ", \t", &save))
+    {
+        if (!strncmp(token, "max-age=", 8))
+        {
+            max_age = strtol(token + 8, NULL, 10);
+        }
+        else if (!strncmp(token, "s-maxage=", 9))
+        {
+            s_maxage = strtol(token + 9, NULL, 10);
+        }
+        else if (!strncmp(token, "no-cache", 8))
+        {
+            no_cache = true;
+        }
+    }
+    if (no_cache)
+    {
+        return 0;
+    }
+    return s_maxage >= 0 ? s_maxage : max_age;
+}
+
+/* an HTTP date in the RFC 1123 form origins send, as a time() second, or -1 */
+static long http_date(const char *value, size_t len)
+{
+    char buf[64];
+    struct tm tm;
+
+    if (len >= sizeof(buf))
+    {
+        return -1;
+    }
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+    {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/* read b's validators and lifetime from its headers */
+static void block_freshness(cache_block *b)
+{
+    const char *value;
+    size_t len;
+
+    b->etag = header_value(b->data, b->size, "ETag:", &b->etag_len);
+    b->last_modified = header_value(b->data, b->size, "Last-Modified:",
+                                    &b->last_modified_len);
+    value = header_value(b->data, b->size, "Cache-Control:", &len);
+    b->max_age = value != NULL ? max_age_of(value, len) : -1;
+    b->expires = 0;
+    b->refreshing = false;
+    if (b->max_age >= 0)
+    {
+        // the age counts from when the origin sent it, so a copy read back
+        // from disk or a snapshot is as old as it really is
+        long now = time(NULL), date = -1;
+        if ((value = header_value(b->data, b->size, "Date:", &len)) != NULL)
+        {
+            date = http_date(value, len);
+        }
+        b->expires = (date < 0 || date > now ? now : date) + b->max_age;
+    }
+}
+
+bool cache_fresh(const cache_block *block)
+{
+    long expires = __atomic_load_n(&block->expires, __ATOMIC_RELAXED);
+    return expires == 0 || time(NULL) < expires;
+}
+
+void cache_refresh(cache_block *block, const char *head, size_t len)
+{
+    size_t value_len;
+    const char *value = header_value(head, len, "Cache-Control:", &value_len);
+    long max_age = value != NULL ? max_age_of(value, value_len) : -1;
+
+    // hits read expires without a lock, a store is all the update takes
+    __atomic_store_n(&block->expires, time(NULL) + (max_age >= 0 ? max_age : block->max_age),
+                     __ATOMIC_RELAXED);
+    __atomic_add_fetch(&revalidations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&revalidated_bytes, block->size, __ATOMIC_RELAXED);
+}
+
+void cache_stats_read(cache_stats *st)
+{
+    st->policy = policy->name;
+    st->tinylfu = admit_by_frequency;
+    pthread_mutex_lock(&writer_lock);
+    st->used = cache_used;
+    st->objects = cache_objects;
+    st->evictions = evictions;
+    st->admitted = admitted;
+    st->rejected = rejected;
+    pthread_mutex_unlock(&writer_lock);
+    st->sketched = __atomic_load_n(&sketch_adds, __ATOMIC_RELAXED);
+    st->agings = __atomic_load_n(&sketch_agings, __ATOMIC_RELAXED);
+    st->revalidated = __atomic_load_n(&revalidations, __ATOMIC_RELAXED);
+    st->saved = __atomic_load_n(&revalidated_bytes, __ATOMIC_RELAXED);
+}
+
+/* a block holding data under key, with one reference, or NULL (and data
+freed) if the object is too big or memory runs out */
+static cache_block *block_new(const char *key, unsigned int hash, char *data,
+                              size_t size)
+{
+    cache_block *b;
+    char *shrunk;
+
+    if (size > MAX_OBJECT_SIZE || (b = malloc(sizeof(cache_block))) == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    // the fill buffer was sized for the largest object, give back the rest
+    if (size > 0 && (shrunk = realloc(data, size)) != NULL)
+    {
+        data = shrunk;
+    }
+    b->key = strdup(key);
+    b->data = data;
+    if (b->key == NULL)
+    {
+        block_free(b);
+        return NULL;
+    }
+    b->size = size;
+    b->hash = hash;
+    b->mapped = false;
+    b->freq = 0;
+    b->queue = 0;
+    b->refcnt = 1;
+    block_freshness(b);
+    return b;
+}
+
+/* link b into the cache, making room for it; false if it was not, because
+the key is cached already (and fresh) or TinyLFU keeps it out */
+static bool link_block(cache_block *b)
+{
+    cache_shard *s = shard_of(b->hash);
+    cache_block *old;
+    bool cached;
+
+    pthread_mutex_lock(&writer_lock);
+
+    // keep a single copy when several clients fetched the same object, but
+    // a copy that went stale gives way to the one fetched to replace it.
+    // Only writers link and unlink, so under writer_lock the chains hold
+    // still and old stays where it is
+    old = find(s, b->key, b->hash);
+    cached = old == NULL || !cache_fresh(old);
+
+    // TinyLFU: a newcomer that needs room has to be wanted more than the
+    // block that would go first; the cache keeps its blocks otherwise. A
+    // copy replacing a stale one is no newcomer: its key has its place, and
+    // keeping it out would leave the key with no copy at all
+    if (cached && old == NULL && admit_by_frequency
+        && cache_used + b->size > MAX_CACHE_SIZE)
+    {
+        unsigned int victim_hash;
+        cached = oldest_shard(&victim_hash) == NULL
+                 || sketch_estimate(b->hash) >= sketch_estimate(victim_hash);
+        if (cached)
+        {
+            admitted++;
+        }
+        else
+        {
+            rejected++;
+        }
+    }
+    if (cached)
+    {
+        if (old != NULL)
+        {
+            pthread_rwlock_wrlock(&s->lock);
+            block_unlink(s, old);
+            pthread_rwlock_unlock(&s->lock);
+            cache_release(old);
+        }
+        while (cache_used + b->size > MAX_CACHE_SIZE && evict_one())
+        {
+        }
+        pthread_rwlock_wrlock(&s->lock);
+        b->hnext = *bucket_of(s, b->hash);
+        *bucket_of(s, b->hash) = b;
+        policy->link(s, b);
+        cache_used += b->size;
+        cache_objects++;
+        pthread_rwlock_unlock(&s->lock);
+    }
+
+    pthread_mutex_unlock(&writer_lock);
+    return cached;
+}
+
+bool cache_insert(const char *key, char *data, size_t size)
+{
+    cache_block *b = block_new(key, cache_hash(key), data, size);
+
+    if (b == NULL)
+    {
+        return false;
+    }
+    if (!link_block(b))
+    {
+        block_free(b);
+        return false;
+    }
+    return true;
+}
+
+cache_block *cache_lookup(const char *key)
+{
+    cache_block *b;
+    char *data;
+    size_t size;
+
+    if ((b = lookup(key, true)) != NULL)
+    {
+        return b;
+    }
+    // a miss in memory may still be on disk (-D); bring it back in
+    if (!disk_get(key, cache_hash(key), &data, &size))
+    {
+        return NULL;
+    }
+    return cache_adopt(key, data, size);
+}
+
+cache_block *cache_lookup_memory(const char *key)
+{
+    return lookup(key, true);
+}
+
+cache_block *cache_adopt(const char *key, char *data, size_t size)
+{
+    // the caller's reference is taken before linking, so if the block is not
+    // linked after all it is simply freed once the caller is done with it
+    cache_block *b = block_new(key, cache_hash(key), data, size);
+    if (b == NULL)
+    {
+        return NULL;
+    }
+    b->refcnt = 2;
+    if (!link_block(b))
+    {
+        b->refcnt = 1;
+    }
+    return b;
+}
+
+cache_block *cache_lookup_coalesced(const char *key, cache_fill **fill)
+{
+    unsigned int hash = cache_hash(key);
+    cache_fill **bucket = &fills[hash & (CACHE_BUCKETS - 1)];
+    cache_block *b;
+    cache_fill *f;
+
+    *fill = NULL;
+    if ((b = cache_lookup(key)) != NULL)
+    {
+        return b;
+    }
+    // the lookups below are for the same request: not counted again
+
+    pthread_mutex_lock(&fill_lock);
+    for (f = *bucket; f != NULL; f = f->next)
+    {
+        if (f->hash == hash && !strcmp(f->key, key))
+        {
+            break;
+        }
+    }
+    if (f == NULL)
+    {
+        // first miss: this caller fetches, everyone after it waits
+        if ((f = calloc(1, sizeof(cache_fill))) == NULL
+            || (f->key = strdup(key)) == NULL)
+        {
+            free(f);
+            pthread_mutex_unlock(&fill_lock);
+            return NULL;
+        }
+        f->hash = hash;
+        pthread_cond_init(&f->cond, NULL);
+        f->next = *bucket;
+        *bucket = f;
+        pthread_mutex_unlock(&fill_lock);
+
+        // a fetch may have completed between our miss and registering
+        if ((b = lookup(key, false)) != NULL)
+        {
+            cache_fill_end(f);
+            return b;
+        }
+        *fill = f;
+        return NULL;
+    }
+
+    f->waiters++;
+    while (!f->done)
+    {
+        pthread_cond_wait(&f->cond, &fill_lock);
+    }
+    // the last one out frees a finished fill
+    if (--f->waiters == 0)
+    {
+        pthread_cond_destroy(&f->cond);
+        free(f->key);
+        free(f);
+    }
+    pthread_mutex_unlock(&fill_lock);
+
+    // NULL here means the fetch was not cacheable, fetch it ourselves
+    return lookup(key, false);
+}
+
+void cache_fill_end(cache_fill *fill)
+{
+    cache_fill **pp = &fills[fill->hash & (CACHE_BUCKETS - 1)];
+
+    pthread_mutex_lock(&fill_lock);
+    while (*pp != fill)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = fill->next;
+    fill->done = true;
+    if (fill->waiters == 0)
+    {
+        pthread_cond_destroy(&fill->cond);
+        free(fill->key);
+        free(fill);
+    }
+    else
+    {
+        pthread_cond_broadcast(&fill->cond);
+    }
+    pthread_mutex_unlock(&fill_lock);
+}
+
+void cache_pending_init(cache_pending *p, bool cacheable)
+{
+    p->data = cacheable ? malloc(MAX_OBJECT_SIZE) : NULL;
+    p->size = 0;
+}
+
+char *cache_pending_space(cache_pending *p, char *buf, size_t buflen,
+                          size_t *len)
+{
+    if (p->data != NULL && p->size < MAX_OBJECT_SIZE)
+    {
+        *len = MAX_OBJECT_SIZE - p->size;
+        return p->data + p->size;
+    }
+    // full (or not kept): one more byte means the response is too big
+    *len = buflen;
+    return buf;
+}
+
+bool cache_pending_append(cache_pending *p, const char *chunk, size_t n)
+{
+    if (p->data == NULL)
+    {
+        return false;
+    }
+    if (chunk == p->data + p->size)
+    {
+        p->size += n;
+        return true;
+    }
+    if (n > 0)
+    {
+        cache_pending_abort(p);
+        return false;
+    }
+    return true;
+}
+
+static void release_block(void *arg)
+{
+    cache_release(arg);
+}
+
+void cache_pending_commit(cache_pending *p, const char *key)
+{
+    cache_block *b;
+
+    if (p->data == NULL)
+    {
+        return;
+    }
+    b = block_new(key, cache_hash(key), p->data, p->size);
+    p->data = NULL;
+    if (b == NULL)
+    {
+        return;
+    }
+    // the disk tier writes it on its own thread, with a reference of its
+    // own so an eviction meanwhile does not free it
+    cache_retain(b);
+    disk_put(b->key, b->hash, b->data, b->size, release_block, b);
+    if (!link_block(b))
+    {
+        cache_release(b);
+    }
+}
+
+void cache_pending_abort(cache_pending *p)
+{
+    free(p->data);
+    p->data = NULL;
+}
+
+// snapshots: a header with TinyLFU's sketch, then one record per block in
+// the order the policy ranks them, lowest first, so linking them back in
+// that order rebuilds the eviction order
+
+#define SNAPSHOT_MAGIC "PXYSNAP1"
+
+typedef struct
+{
+    char magic[8];
+    uint32_t count;  /* records that follow */
+    uint32_t policy; /* index of the policy that wrote it */
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+} snapshot_head;
+
+typedef struct
+{
+    uint32_t keylen; /* the key follows, then the data */
+    uint32_t size;
+    uint32_t freq;   /* the policy's hit count */
+    uint32_t sum;    /* FNV-1a of key and data */
+} snapshot_record;
+
+typedef struct
+{
+    cache_block *b;
+    unsigned long rank;
+} ranked_block;
+
+static uint32_t snapshot_sum(const char *key, size_t keylen, const char *data,
+                             size_t size)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < keylen + size; i++)
+    {
+        h ^= (unsigned char)(i < keylen ? key[i] : data[i - keylen]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int rank_cmp(const void *a, const void *b)
+{
+    unsigned long x = ((const ranked_block *)a)->rank;
+    unsigned long y = ((const ranked_block *)b)->rank;
+    return x < y ? -1 : x > y;
+}
+
+bool cache_snapshot(const char *path)
+{
+    ranked_block *all = NULL, *grown;
+    size_t n = 0, cap = 0;
+    snapshot_head head;
+    char tmp[PATH_MAX];
+    FILE *fp = NULL;
+    bool ok = true;
+
+    // take a reference on every block so none is freed while we write it
+    // out; the data is immutable, so the locks can go before the writing
+    pthread_mutex_lock(&writer_lock);
+    for (int i = 0; i < CACHE_SHARDS && ok; i++)
+    {
+        cache_shard *s = &shards[i];
+        pthread_rwlock_rdlock(&s->lock);
+        for (int q = 0; q < 2 && ok; q++)
+        {
+            for (cache_block *b = s->order[q].next; b != &s->order[q]; b = b->next)
+            {
+                if (n == cap)
+                {
+                    if ((grown = realloc(all, (2 * cap + 64) * sizeof(*all))) == NULL)
+                    {
+                        ok = false;
+                        break;
+                    }
+                    all = grown;
+                    cap = 2 * cap + 64;
+                }
+                __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+                all[n].b = b;
+                all[n++].rank = policy->rank(b);
+            }
+        }
+        pthread_rwlock_unlock(&s->lock);
+    }
+    memcpy(head.magic, SNAPSHOT_MAGIC, sizeof(head.magic));
+    head.count = n;
+    head.policy = policy - policies;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        for (int i = 0; i < SKETCH_WIDTH; i++)
+        {
+            head.sketch[row][i] = __atomic_load_n(&sketch[row][i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    // written next to the old snapshot and renamed over it, so a restore
+    // never maps a half-written file
+    qsort(all, n, sizeof(*all), rank_cmp);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    ok = ok && (fp = fopen(tmp, "w")) != NULL;
+    ok = ok && fwrite(&head, sizeof(head), 1, fp) == 1;
+    for (size_t i = 0; i < n && ok; i++)
+    {
+        cache_block *b = all[i].b;
+        snapshot_record rec;
+        rec.keylen = strlen(b->key);
+        rec.size = b->size;
+        rec.freq = __atomic_load_n(&b->freq, __ATOMIC_RELAXED);
+        rec.sum = snapshot_sum(b->key, rec.keylen, b->data, b->size);
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1
+             && fwrite(b->key, 1, rec.keylen, fp) == rec.keylen
+             && fwrite(b->data, 1, b->size, fp) == b->size;
+    }
+    if (fp != NULL && fclose(fp) != 0)
+    {
+        ok = false;
+    }
+    if (!(ok && rename(tmp, path) == 0))
+    {
+        unlink(tmp);
+        ok = false;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+        cache_release(all[i].b);
+    }
+    free(all);
+    return ok;
+}
+
+int cache_restore(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    char *map;
+    size_t off = sizeof(snapshot_head);
+    int restored = 0;
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_head))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    const snapshot_head *head = (const snapshot_head *)map;
+    if (memcmp(head->magic, SNAPSHOT_MAGIC, sizeof(head->magic)))
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the counts first, so TinyLFU weighs the restored blocks as it did
+    if (admit_by_frequency)
+    {
+        for (int row = 0; row < SKETCH_DEPTH; row++)
+        {
+            for (int i = 0; i < SKETCH_WIDTH; i++)
+            {
+                if (head->sketch[row][i] > __atomic_load_n(&sketch[row][i], __ATOMIC_RELAXED))
+                {
+                    __atomic_store_n(&sketch[row][i], head->sketch[row][i], __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+
+    // each record is checked just before it is linked, while the proxy is
+    // already serving; a key fetched meanwhile keeps the fresh copy. The
+    // blocks' data stays in the mapping, nothing is copied
+    for (uint32_t i = 0; i < head->count; i++)
+    {
+        snapshot_record rec;
+        cache_block *b;
+        if ((size_t)st.st_size - off < sizeof(rec))
+        {
+            break;
+        }
+        memcpy(&rec, map + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.keylen >= CACHE_KEYLEN
+            || (size_t)st.st_size - off < (size_t)rec.keylen + rec.size)
+        {
+            break; // cut short: keep what came before
+        }
+        const char *key = map + off;
+        char *data = map + off + rec.keylen;
+        off += rec.keylen + rec.size;
+        if (rec.size > MAX_OBJECT_SIZE
+            || snapshot_sum(key, rec.keylen, data, rec.size) != rec.sum
+            || (b = malloc(sizeof(cache_block))) == NULL)
+        {
+            continue;
+        }
+        if ((b->key = strndup(key, rec.keylen)) == NULL)
+        {
+            free(b);
+            continue;
+        }
+        b->data = data;
+        b->size = rec.size;
+        b->hash = cache_hash(b->key);
+        b->mapped = true;
+        b->freq = 0;
+        b->queue = 0;
+        b->refcnt = 2; // ours keeps it alive until its count is set
+        block_freshness(b);
+        if (link_block(b))
+        {
+            if (head->policy == (uint32_t)(policy - policies))
+            {
+                __atomic_store_n(&b->freq, rec.freq, __ATOMIC_RELAXED);
+            }
+            restored++;
+        }
+        else
+        {
+            b->refcnt = 1;
+        }
+        cache_release(b);
+    }
 
+    // restored blocks point into the mapping, so it stays for good
+    if (restored == 0)
+    {
+        munmap(map, st.st_size);
+    }
+    return restored;
+}
@@ -5,6 +5,11 @@ when client request some already existed url(key) in the cache, instead of retri
 cache will direcly send the saved reply from server to the client, which has higher efficiency
 */
 
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
 
 //define some dimension limits constants or storage limits constants
 /*
@@ -14,14 +19,194 @@ cache will direcly send the saved reply from server to the client, which has hig
 #define MAX_CACHE_SIZE (1024 * 1024)
 #define MAX_OBJECT_SIZE (100 * 1024)
 
+/* the table is split into CACHE_SHARDS independently locked parts, picked
+by the key's hash, so requests for different keys rarely meet on a lock */
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256 /* hash buckets per shard, power of two */
+
+/* longest normalized key: host:port/path */
+#define CACHE_KEYLEN 8192
 
 //define the basic cache block structure
 typedef struct cache_block
 {
     /* each cache block store url as key, complete response made by a server to a client,
-    including any response headers(char*), 
+    including any response headers(char*),
     */
-   
-};
+    char *key;
+    char *data; /* immutable once cached, written straight to clients */
+    size_t size;
+    unsigned int hash;
+    bool mapped; /* data is in a restored snapshot's mapping, not malloc()ed */
+
+    /* with LRU, last time this block was used (CLOCK_MONOTONIC ns). Hits
+    only store the new time; the block is moved to the front of its shard's
+    LRU list lazily, when the writer path finds it at the tail with a stamp
+    newer than "placed", the stamp it had when it was last put at the front.
+    GDSF keeps its clock at the last hit here and its rank in "placed";
+    S3-FIFO keeps when the block entered its queue in "placed" */
+    unsigned long stamp;
+    unsigned long placed;
+    unsigned int freq;   /* hits counted by GDSF and S3-FIFO */
+    unsigned char queue; /* S3-FIFO: the queue it is in */
+
+    /* how long the origin said the response stays fresh, read from its
+    headers when the block is made. The validators point into data, NULL if
+    the origin sent none. "expires" is a time() second, 0 if the response
+    has no max-age and never goes stale; a 304 moves it forward */
+    const char *etag;
+    const char *last_modified;
+    size_t etag_len, last_modified_len;
+    long max_age; /* Cache-Control s-maxage or max-age, -1 if not given */
+    long expires;
+    bool refreshing; /* a background refresh (-r) of it is queued or running */
+
+    /* one reference is held by the cache while the block is linked, and one
+    by every reader streaming it to a client; the last one frees the block */
+    int refcnt;
+
+    struct cache_block *hnext; /* hash bucket chain */
+    struct cache_block *prev;  /* the policy's list, newest at the front */
+    struct cache_block *next;
+} cache_block;
+
+/* the eviction policies cache_init() takes, NULL-terminated: "lru" (the
+default), "s3fifo" (a small FIFO for new objects in front of a CLOCK main
+queue, so objects asked for once leave early) and "gdsf" (GreedyDual-Size-
+Frequency: keeps small objects asked for often, for a higher object hit
+ratio) */
+extern const char *const cache_policy_names[];
+
+/* set up the empty cache, call once before any other cache function; returns
+false if policy is not one of cache_policy_names. With tinylfu set, a new
+object is only cached in place of others if it has been looked up more often
+than the block the policy would evict first */
+bool cache_init(const char *policy, bool tinylfu);
+
+/* build the lookup key for a request: lowercase host, explicit port, the
+pathlen bytes of path; returns false if it does not fit in CACHE_KEYLEN, such
+requests are not cached */
+bool cache_make_key(char *key, const char *hostname, const char *port,
+                    const char *path, size_t pathlen);
+
+/* find a block and count the hit for the eviction policy; the caller gets
+its own reference and must hand it back with cache_release() after writing it
+out. Lookups only take their shard's lock in shared mode, so hits run in
+parallel. A miss is looked up on disk too if the disk tier is open */
+cache_block *cache_lookup(const char *key);
+
+/* cache_lookup() for a caller that must not wait for the disk: memory only.
+Such a caller asks the disk tier with disk_submit() itself on a miss, and
+hands what comes back to cache_adopt() */
+cache_block *cache_lookup_memory(const char *key);
+
+/* bring an object read from the disk tier back into memory, as a
+cache_lookup() miss does; the cache takes over data (from malloc). Returns
+the block with a reference for the caller, NULL if out of memory */
+cache_block *cache_adopt(const char *key, char *data, size_t size);
+
+/* drop a reference returned by cache_lookup() */
+void cache_release(cache_block *block);
+
+/* take one more reference to a block the caller holds one to, for handing
+it to another thread */
+void cache_retain(cache_block *block);
+
+/* whether a block from cache_lookup() may be served without asking the
+origin. A stale one is revalidated with a conditional GET if it has a
+validator (ETag or Last-Modified) and fetched again if not; either way the
+new response replaces it when inserted */
+bool cache_fresh(const cache_block *block);
+
+/* the origin answered a stale block's conditional GET with 304 Not
+Modified, whose head is the len bytes at head: the block is fresh again for
+the 304's max-age, or its own if the 304 gives none, and its size is counted
+as bytes the origin did not have to send again */
+void cache_refresh(cache_block *block, const char *head, size_t len);
+
+/* what the cache holds and has done since cache_init() */
+typedef struct
+{
+    const char *policy;        /* the eviction policy's name */
+    bool tinylfu;              /* admission by frequency is on */
+    size_t used;               /* bytes cached */
+    unsigned long objects;     /* blocks cached */
+    unsigned long evictions;   /* blocks the policy gave up for room */
+    unsigned long admitted;    /* TinyLFU: newcomers let in over a victim */
+    unsigned long rejected;    /* TinyLFU: newcomers kept out */
+    unsigned long sketched;    /* TinyLFU: lookups counted, added up in batches */
+    unsigned long agings;      /* TinyLFU: times the sketch was halved */
+    unsigned long revalidated; /* stale blocks a 304 made fresh again */
+    unsigned long saved;       /* bytes those 304s did not send again */
+} cache_stats;
+
+/* read the cache's numbers; takes the writer lock for a moment, so it is
+for the occasional report, not for the request path */
+void cache_stats_read(cache_stats *st);
+
+/* put a complete response into the cache, evicting what the policy picks
+to make room. The cache takes over data (from malloc) as the block's buffer
+instead of copying it, and frees it if the response is too big, the
+key is already cached (and fresh) or TinyLFU does not admit it; either way the caller
+must not touch it again */
+bool cache_insert(const char *key, char *data, size_t size);
+
+/* a response being streamed from the origin to a client, kept on the side
+so it can be cached once complete. Reads from the origin land directly in
+data while the response still fits, and the client is written from there,
+so teeing a response into the cache costs no copy */
+typedef struct cache_pending
+{
+    char *data; /* NULL if nothing is kept: not cacheable or grew too big */
+    size_t size;
+} cache_pending;
+
+/* start keeping a response; with cacheable false nothing is kept */
+void cache_pending_init(cache_pending *p, bool cacheable);
+
+/* where the next read from the origin should go: the free part of the
+pending buffer while there is room, otherwise buf (of buflen bytes) */
+char *cache_pending_space(cache_pending *p, char *buf, size_t buflen,
+                          size_t *len);
+
+/* account for n bytes read into the space cache_pending_space() returned;
+returns false once the response can no longer be cached */
+bool cache_pending_append(cache_pending *p, const char *chunk, size_t n);
+
+/* the response ended: cache it under key if it was kept, and queue it for
+the disk tier if that is open */
+void cache_pending_commit(cache_pending *p, const char *key);
+
+/* the response did not complete: drop whatever was kept */
+void cache_pending_abort(cache_pending *p);
+
+/* a fetch in progress for a key that missed (single-flight) */
+typedef struct cache_fill cache_fill;
+
+/* like cache_lookup(), but when another thread is already fetching key,
+wait for that fetch to finish and look again instead of going to the origin
+too. On a miss *fill is set if the caller now owns the fetch, and it must
+call cache_fill_end() once the response is inserted or given up; otherwise
+*fill is NULL and the caller fetches on its own */
+cache_block *cache_lookup_coalesced(const char *key, cache_fill **fill);
+
+/* finish a fetch claimed by cache_lookup_coalesced() and wake its waiters */
+void cache_fill_end(cache_fill *fill);
+
+/* write everything cached to path: keys, data, the eviction order and hit
+counts, and TinyLFU's sketch. The blocks are only locked while references
+to them are taken, not while they are written. The file is written beside
+path and renamed over it; returns false if that failed */
+bool cache_snapshot(const char *path);
+
+/* load what cache_snapshot() wrote to path: the file is mapped, and each
+object is checked and linked in turn, its data left in the mapping. Meant
+to run on its own thread while the proxy already serves, so a key fetched
+meanwhile keeps the fresh copy. Returns how many objects were restored, or
+-1 with errno set if path is not a snapshot */
+int cache_restore(const char *path);
 
+/* the hash the cache files key under, for callers keeping their own tables */
+unsigned int cache_hash(const char *key);
 
+#endif /* CACHE_H */
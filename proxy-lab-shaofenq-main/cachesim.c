@@ -0,0 +1,262 @@
+/*
+ * cachesim.c - hit ratios of the proxy's cache on replayed fetch sequences
+ *
+ * A trace is a list of accesses, each a key and the size of its response.
+ * Every access is a cache_lookup(); a miss is then inserted with
+ * cache_insert(), as the proxy does once the origin has answered. The real
+ * cache.c does the work, so what is measured is exactly what the proxy
+ * would keep. Reported for each trace and each eviction policy (-p), and
+ * for LRU with TinyLFU admission (-f) as well: the object hit ratio
+ * (accesses served from the cache) and the byte hit ratio (bytes served
+ * from the cache over bytes asked for).
+ *
+ * Traces come from the pxydrive scripts named on the command line, such as
+ * tests/D*.cmd: "generate NAME SIZE" gives a file's size (K is 1000 bytes,
+ * as in pxydrive), and every "fetch" or "request" of it from a server is an
+ * access. A response is taken to be the file plus HEAD_BYTES of headers.
+ * Each script starts from an empty cache.
+ *
+ * The test scripts are short and mostly ask for a file once, so a
+ * synthetic trace is always run as well: a hot set asked for with a Zipf
+ * distribution, between scans of files asked for only once, which is what
+ * D11/D12 do to an LRU cache. Its generator has a fixed seed, so every run
+ * replays the same trace.
+ *
+ * Not part of the proxy (listed in .tarignore); build and run with
+ *     gcc -O2 -std=c99 -I. cachesim.c cache.c disk.c -o cachesim \
+ *         -lpthread -lm
+ *     ./cachesim tests/D*.cmd
+ */
+
+#include "cache.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEAD_BYTES 100   /* status line and headers of a response */
+#define MAX_FILES 512
+#define MAX_ACCESSES 65536
+
+/* the synthetic trace: HOT_FILES asked for HOT_ROUND times per round with
+Zipf exponent HOT_SKEW, then SCAN_FILES new ones once each */
+#define HOT_FILES 48
+#define HOT_SKEW 0.9
+#define HOT_ROUND 300
+#define SCAN_FILES 50
+#define ROUNDS 40
+
+typedef struct {
+    char key[128];
+    size_t size;
+} access;
+
+typedef struct {
+    access *acc;
+    int n;
+} trace;
+
+typedef struct {
+    long hits, accesses;
+    double hit_bytes, bytes;
+} result;
+
+/* the caches compared, one column each */
+static const struct {
+    const char *title, *policy;
+    bool tinylfu;
+} configs[] = {
+    {"LRU", "lru", false},
+    {"LRU + TinyLFU", "lru", true},
+    {"S3-FIFO", "s3fifo", false},
+    {"GDSF", "gdsf", false},
+};
+#define NCONFIGS (int)(sizeof(configs) / sizeof(configs[0]))
+
+static void add(trace *t, const char *key, size_t size)
+{
+    if (t->n == MAX_ACCESSES) {
+        return;
+    }
+    snprintf(t->acc[t->n].key, sizeof(t->acc[t->n].key), "%s", key);
+    t->acc[t->n++].size = size + HEAD_BYTES;
+}
+
+/* the accesses a pxydrive script makes; false if it cannot be read */
+static bool load_cmd(const char *path, trace *t)
+{
+    static struct {
+        char name[48];
+        size_t size;
+    } files[MAX_FILES];
+    int nfiles = 0;
+    char line[256], a[48], b[48], c[48];
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        return false;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "generate %47s %47s", a, b) == 2 && nfiles < MAX_FILES) {
+            double size = atof(b);
+            char unit = b[strlen(b) - 1];
+            if (unit == 'K' || unit == 'k') {
+                size *= 1000;
+            } else if (unit == 'M' || unit == 'm') {
+                size *= 1000 * 1000;
+            }
+            snprintf(files[nfiles].name, sizeof(files[nfiles].name), "%s", a);
+            files[nfiles++].size = (size_t)size;
+        } else if (sscanf(line, "fetch %47s %47s %47s", a, b, c) == 3
+                   || sscanf(line, "request %47s %47s %47s", a, b, c) == 3) {
+            for (int i = 0; i < nfiles; i++) {
+                if (!strcmp(files[i].name, b)) {
+                    char key[128];
+                    snprintf(key, sizeof(key), "%s/%s", c, b);
+                    add(t, key, files[i].size);
+                    break;
+                }
+            }
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+/* xorshift64*, so the synthetic trace is the same on every run */
+static unsigned long long rng = 0x2545f4914f6cdd1dull;
+
+static double uniform(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double)((rng * 0x2545f4914f6cdd1dull) >> 11) / (1ull << 53);
+}
+
+static void make_synthetic(trace *t)
+{
+    double cdf[HOT_FILES], sum = 0;
+    char key[64];
+    int scanned = 0;
+
+    for (int i = 0; i < HOT_FILES; i++) {
+        sum += 1 / pow(i + 1, HOT_SKEW);
+        cdf[i] = sum;
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int k = 0; k < HOT_ROUND; k++) {
+            double u = uniform() * sum;
+            int i = 0;
+            while (cdf[i] < u && i < HOT_FILES - 1) {
+                i++;
+            }
+            snprintf(key, sizeof(key), "hot/%d", i);
+            add(t, key, 4000 + 1000 * (i % 13)); /* 4K to 16K */
+        }
+        for (int k = 0; k < SCAN_FILES; k++) {
+            snprintf(key, sizeof(key), "scan/%d", scanned++);
+            add(t, key, 20000); /* D12's files */
+        }
+    }
+}
+
+/* replay t on an empty cache. cache_init() does not free the blocks a
+previous run left behind; that memory is simply lost, which is fine here */
+static result replay(const trace *t, int config)
+{
+    result r = {0, 0, 0, 0};
+
+    cache_init(configs[config].policy, configs[config].tinylfu);
+    for (int i = 0; i < t->n; i++) {
+        const access *a = &t->acc[i];
+        cache_block *b = cache_lookup(a->key);
+        r.accesses++;
+        r.bytes += a->size;
+        if (b != NULL) {
+            r.hits++;
+            r.hit_bytes += a->size;
+            cache_release(b);
+        } else {
+            char *data = malloc(a->size);
+            if (data != NULL) {
+                cache_insert(a->key, data, a->size);
+            }
+        }
+    }
+    return r;
+}
+
+static void sum_into(result *total, const result *r)
+{
+    total->hits += r->hits;
+    total->accesses += r->accesses;
+    total->hit_bytes += r->hit_bytes;
+    total->bytes += r->bytes;
+}
+
+static void report(const char *name, const result *r)
+{
+    printf("%-26s %7ld", name, r[0].accesses);
+    for (int i = 0; i < NCONFIGS; i++) {
+        printf("   %6.1f%% %6.1f%%",
+               r[i].accesses ? 100.0 * r[i].hits / r[i].accesses : 0.0,
+               r[i].bytes > 0 ? 100.0 * r[i].hit_bytes / r[i].bytes : 0.0);
+    }
+    printf("\n");
+}
+
+static void run(const char *name, const trace *t, result *total)
+{
+    result r[NCONFIGS];
+    for (int i = 0; i < NCONFIGS; i++) {
+        r[i] = replay(t, i);
+        if (total != NULL) {
+            sum_into(&total[i], &r[i]);
+        }
+    }
+    report(name, r);
+}
+
+int main(int argc, char **argv)
+{
+    trace t = {malloc(MAX_ACCESSES * sizeof(access)), 0};
+    result total[NCONFIGS];
+
+    if (t.acc == NULL) {
+        return 1;
+    }
+    memset(total, 0, sizeof(total));
+    printf("%-26s %7s", "", "");
+    for (int i = 0; i < NCONFIGS; i++) {
+        printf(i < NCONFIGS - 1 ? "   %-16s" : "   %s", configs[i].title);
+    }
+    printf("\n%-26s %7s", "trace", "access");
+    for (int i = 0; i < NCONFIGS; i++) {
+        printf("   %7s %7s", "objects", "bytes");
+    }
+    printf("\n");
+    for (int i = 1; i < argc; i++) {
+        const char *slash = strrchr(argv[i], '/');
+        char name[64];
+        snprintf(name, sizeof(name), "%s", slash != NULL ? slash + 1 : argv[i]);
+        if (strlen(name) > 4 && !strcmp(name + strlen(name) - 4, ".cmd")) {
+            name[strlen(name) - 4] = '\0';
+        }
+        t.n = 0;
+        if (!load_cmd(argv[i], &t)) {
+            fprintf(stderr, "cannot read %s\n", argv[i]);
+            return 1;
+        }
+        run(name, &t, total);
+    }
+    if (argc > 1) {
+        report("all scripts", total);
+    }
+
+    t.n = 0;
+    make_synthetic(&t);
+    run("hot set + scans", &t, NULL);
+    return 0;
+}
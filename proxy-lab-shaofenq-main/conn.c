@@ -0,0 +1,209 @@
+/*
+ * conn.c - race an origin's addresses for a connection (Happy Eyeballs)
+ *
+ * The addresses are reordered so the families alternate, starting with
+ * the one the resolver listed first: a broken IPv6 route then costs one
+ * attempt delay instead of every IPv6 address in turn.
+ */
+
+#include "conn.h"
+#include "resolver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+static unsigned long timeout_ms = CONN_TIMEOUT_SECS * 1000UL;
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void conn_init(int timeout_secs)
+{
+    timeout_ms = (unsigned long)timeout_secs * 1000;
+}
+
+/* res with the families interleaved, first family first */
+static void interleave(resolver_result *out, const resolver_result *res)
+{
+    bool taken[RESOLVER_MAXADDRS] = {false};
+    int family = res->count > 0 ? res->addr[0].family : 0;
+
+    out->count = 0;
+    while (out->count < res->count) {
+        int i;
+        for (i = 0; i < res->count; i++) {
+            if (!taken[i] && res->addr[i].family == family) {
+                break;
+            }
+        }
+        if (i == res->count) {
+            /* none of this family left: take the next of any family */
+            for (i = 0; taken[i]; i++) {
+            }
+        }
+        taken[i] = true;
+        out->addr[out->count++] = res->addr[i];
+        for (int j = 0; j < res->count; j++) {
+            if (!taken[j] && res->addr[j].family != res->addr[i].family) {
+                family = res->addr[j].family;
+                break;
+            }
+        }
+    }
+}
+
+void conn_race_start(conn_race *cr, const resolver_result *res)
+{
+    interleave(&cr->addrs, res);
+    for (int i = 0; i < RESOLVER_MAXADDRS; i++) {
+        cr->fd[i] = -1;
+    }
+    cr->next = 0;
+    cr->live = 0;
+    cr->error = ECONNREFUSED;
+    cr->next_start = now_ms();
+    cr->deadline = cr->next_start + timeout_ms;
+}
+
+/* start a non-blocking connect to the next address */
+static void start_attempt(conn_race *cr)
+{
+    int i = cr->next++;
+    resolver_addr *a = &cr->addrs.addr[i];
+    int fd = socket(a->family, a->socktype, a->protocol);
+    if (fd < 0) {
+        cr->error = errno;
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *)&a->addr, a->addrlen) < 0
+        && errno != EINPROGRESS) {
+        cr->error = errno;
+        close(fd);
+        return;
+    }
+    /* even a connect() that is done at once is reported writable */
+    cr->fd[i] = fd;
+    cr->live++;
+}
+
+bool conn_race_poll(conn_race *cr)
+{
+    unsigned long now = now_ms();
+    if (now >= cr->deadline) {
+        conn_race_abort(cr);
+        errno = ETIMEDOUT;
+        return false;
+    }
+    while (cr->next < cr->addrs.count
+           && (cr->live == 0 || now >= cr->next_start)) {
+        start_attempt(cr);
+        cr->next_start = now + CONN_ATTEMPT_DELAY_MS;
+    }
+    if (cr->live == 0) {
+        errno = cr->error;
+        return false;
+    }
+    return true;
+}
+
+int conn_race_ready(conn_race *cr, int i)
+{
+    int fd = cr->fd[i], err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+        err = errno;
+    }
+    if (err == EINPROGRESS) {
+        return -1; /* not yet, after all */
+    }
+    cr->fd[i] = -1;
+    cr->live--;
+    if (err != 0) {
+        cr->error = err;
+        close(fd);
+        return -1;
+    }
+    conn_race_abort(cr);
+    return fd;
+}
+
+int conn_race_wait(const conn_race *cr)
+{
+    unsigned long now = now_ms();
+    unsigned long when = cr->deadline;
+    if (cr->next < cr->addrs.count && cr->next_start < when) {
+        when = cr->next_start;
+    }
+    return when > now ? (int)(when - now) : 0;
+}
+
+void conn_race_abort(conn_race *cr)
+{
+    for (int i = 0; i < cr->addrs.count; i++) {
+        if (cr->fd[i] >= 0) {
+            close(cr->fd[i]);
+            cr->fd[i] = -1;
+        }
+    }
+    cr->live = 0;
+    cr->next = cr->addrs.count;
+}
+
+int conn_open(const resolver_result *res)
+{
+    struct pollfd pfd[RESOLVER_MAXADDRS];
+    int idx[RESOLVER_MAXADDRS];
+    conn_race cr;
+
+    conn_race_start(&cr, res);
+    while (conn_race_poll(&cr)) {
+        int n = 0;
+        for (int i = 0; i < cr.addrs.count; i++) {
+            if (cr.fd[i] >= 0) {
+                pfd[n].fd = cr.fd[i];
+                pfd[n].events = POLLOUT;
+                idx[n++] = i;
+            }
+        }
+        if (poll(pfd, n, conn_race_wait(&cr)) < 0 && errno != EINTR) {
+            conn_race_abort(&cr);
+            return -1;
+        }
+        for (int k = 0; k < n; k++) {
+            int fd;
+            if (pfd[k].revents != 0 && (fd = conn_race_ready(&cr, idx[k])) >= 0) {
+                /* the threaded relay works on blocking sockets */
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+                return fd;
+            }
+        }
+    }
+    return -1;
+}
+
+int conn_connect(const char *host, const char *port)
+{
+    resolver_result res;
+    int rc;
+
+    if ((rc = resolver_lookup(host, port, &res)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        return -2;
+    }
+    return conn_open(&res);
+}
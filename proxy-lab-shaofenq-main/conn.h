@@ -0,0 +1,70 @@
+/**
+ * @file conn.h
+ * @brief Connecting to an origin: racing its addresses, with a timeout
+ *
+ * open_clientfd() tries an origin's addresses one after another with a
+ * blocking connect(), so an address that does not answer costs a full TCP
+ * timeout before the next one gets a chance. Here every attempt is non-
+ * blocking: the first address is tried at once, and while no attempt has
+ * succeeded another one starts every CONN_ATTEMPT_DELAY_MS or as soon as
+ * one fails (Happy Eyeballs, RFC 8305), alternating address families. The
+ * first socket to connect wins and the others are closed. The whole race
+ * gives up after the connect timeout (-t).
+ *
+ * A conn_race holds the attempts of one connection. Worker threads wait
+ * for it with conn_open(); the event loop watches its sockets for
+ * writability itself and drives it with conn_race_ready() and
+ * conn_race_poll().
+ */
+
+#ifndef CONN_H
+#define CONN_H
+
+#include "resolver.h"
+
+#include <stdbool.h>
+
+#define CONN_ATTEMPT_DELAY_MS 250 /* head start each attempt gets */
+#define CONN_TIMEOUT_SECS 10      /* default limit for the whole race */
+
+/* Give up on a connection after timeout_secs seconds */
+void conn_init(int timeout_secs);
+
+typedef struct {
+    resolver_result addrs;     /* in the order they are tried */
+    int fd[RESOLVER_MAXADDRS]; /* attempt on each address, -1 if none runs */
+    int next;                  /* next address to try */
+    int live;                  /* attempts running */
+    unsigned long next_start;  /* CLOCK_MONOTONIC ms the next one may start */
+    unsigned long deadline;    /* when the race is given up */
+    int error;                 /* errno of the last attempt that failed */
+} conn_race;
+
+/* Start connecting to one of the addresses in res */
+void conn_race_start(conn_race *cr, const resolver_result *res);
+
+/* Start the attempts that are due. Returns false once the race is lost:
+all addresses failed or the timeout passed (errno says which); every
+socket is closed then */
+bool conn_race_poll(conn_race *cr);
+
+/* Attempt i reported writable: its socket if it connected, which ends the
+race and closes the other attempts, or -1 if it failed, after which
+conn_race_poll() starts the next one */
+int conn_race_ready(conn_race *cr, int i);
+
+/* Milliseconds until conn_race_poll() has something to do */
+int conn_race_wait(const conn_race *cr);
+
+/* Close every attempt still running */
+void conn_race_abort(conn_race *cr);
+
+/* Race the addresses in res and wait for the winner: a connected blocking
+socket, or -1 with errno set */
+int conn_open(const resolver_result *res);
+
+/* open_clientfd() with a cached lookup and conn_open(): a connected
+socket, -2 if the name does not resolve or -1 if no address connects */
+int conn_connect(const char *host, const char *port);
+
+#endif /* CONN_H */
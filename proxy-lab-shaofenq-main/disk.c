@@ -0,0 +1,742 @@
+/*
+ * disk.c - the on-disk cache tier: a segment log and a mapped index
+ *
+ * A record is a disk_record header, the key and the data. Records are only
+ * ever appended to the newest segment, the head; the index maps the key's
+ * two hashes to the segment, offset and length of its latest record. It is
+ * an open addressing table with linear probing, and a delete shifts the
+ * entries after the hole back, so there are no tombstones to clean up.
+ * Inserts never move an entry, only deletes do, and only the compaction
+ * thread deletes.
+ *
+ * index_lock covers the index, the segment table and its byte counts.
+ * Lookups take it shared and read the record while holding it, so the
+ * segment cannot be closed under them. append_lock serializes writers of
+ * the head: a writer appends with only that held and takes index_lock
+ * exclusively to publish the record once it is written, so a lookup never
+ * finds a record that is still being written.
+ *
+ * disk_put() only queues the object, under compact_lock, and wakes the
+ * background thread, which writes what is queued before it looks at the
+ * segments, and again after each one it compacts. disk_submit() queues a
+ * lookup the same way; the thread answers those first, since a client
+ * waits on each, and puts them on a done list. A byte written to a
+ * non-blocking pipe wakes whoever watches disk_fd(), as in resolver.c.
+ */
+
+#define _GNU_SOURCE /* pwritev */
+
+#include "disk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DISK_MAGIC 0x31595850u /* "PXY1", starts every record */
+#define DISK_MAX_SEGS (DISK_MAX_SIZE / DISK_SEG_SIZE + 8)
+#define DISK_MAX_ENTRIES (DISK_SLOTS / 4 * 3)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hash;   /* cache_hash() of the key */
+    uint32_t keylen;
+    uint32_t size;   /* of the data */
+    uint32_t sum;    /* FNV-1a of the data */
+} disk_record;
+
+/* an index entry; len 0 marks a free slot */
+typedef struct {
+    uint32_t hash, hash2; /* both must match; the key is checked on reads */
+    uint32_t seg;         /* segment id */
+    uint32_t off;
+    uint32_t len;         /* of the whole record */
+} disk_slot;
+
+/* the index file */
+typedef struct {
+    char magic[8];
+    uint32_t nslots;
+    uint32_t next_seg; /* id of the next segment to create */
+    uint32_t count;    /* slots in use */
+    uint32_t unused;
+    disk_slot slots[];
+} disk_index;
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    size_t size; /* bytes written */
+    size_t live; /* bytes of the records the index points at */
+} disk_seg;
+
+static const char index_magic[8] = "PXYIDX1";
+
+static bool opened;
+static char *disk_dir;
+static disk_index *idx;
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static disk_seg segs[DISK_MAX_SEGS]; /* oldest first */
+static int nsegs;
+static uint32_t head_id; /* 0 until the first write */
+
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static int head_fd = -1;
+static size_t head_size;
+
+/* an object disk_put() left for the background thread */
+typedef struct {
+    const char *key;
+    unsigned int hash;
+    const char *data;
+    size_t size;
+    void (*done)(void *arg);
+    void *arg;
+} disk_write;
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_wake = PTHREAD_COND_INITIALIZER;
+static disk_write writes[DISK_QUEUE]; /* a ring, under compact_lock */
+static int writes_head, writes_len;
+static disk_query *reads_head, *reads_tail; /* disk_submit()ted, FIFO */
+static int reads_len;
+static disk_query *done_head, *done_tail; /* waiting for disk_done() */
+static int notify[2] = {-1, -1};
+
+static uint32_t checksum(const char *p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    while (n-- > 0) {
+        h ^= (unsigned char)*p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* djb2, so that two keys must collide in two unrelated hashes to share an
+index entry */
+static uint32_t second_hash(const char *key)
+{
+    uint32_t h = 5381;
+    for (; *key; key++) {
+        h = h * 33 + (unsigned char)*key;
+    }
+    return h;
+}
+
+static uint32_t next_slot(uint32_t i)
+{
+    return (i + 1) & (DISK_SLOTS - 1);
+}
+
+/* where the key's probe sequence starts; cache_hash() is mixed again since
+the memory cache already used its low bits */
+static uint32_t home_slot(uint32_t hash)
+{
+    return ((hash * 0x9e3779b1u) >> 8) & (DISK_SLOTS - 1);
+}
+
+/* the entry for the hashes, or the free slot where it would go; the table
+is never full, so the walk ends. Caller holds index_lock */
+static disk_slot *slot_find(uint32_t hash, uint32_t hash2)
+{
+    uint32_t i = home_slot(hash);
+    while (idx->slots[i].len != 0
+           && (idx->slots[i].hash != hash || idx->slots[i].hash2 != hash2)) {
+        i = next_slot(i);
+    }
+    return &idx->slots[i];
+}
+
+/* empty slot i, moving back the entries after it that would no longer be
+found past the hole. Caller holds index_lock exclusively */
+static void slot_delete(uint32_t i)
+{
+    uint32_t j = i;
+    while (idx->slots[j = next_slot(j)].len != 0) {
+        uint32_t k = home_slot(idx->slots[j].hash);
+        /* j stays if its home is cyclically in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+        }
+        idx->slots[i] = idx->slots[j];
+        i = j;
+    }
+    idx->slots[i].len = 0;
+    idx->count--;
+}
+
+/* caller holds index_lock */
+static disk_seg *seg_find(uint32_t id)
+{
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].id == id) {
+            return &segs[i];
+        }
+    }
+    return NULL;
+}
+
+static void seg_path(char *path, size_t n, uint32_t id)
+{
+    snprintf(path, n, "%s/%08x.seg", disk_dir, id);
+}
+
+/* read the record at off in fd and check it really is key's; on success
+*data is the object, moved to the start of the malloc()ed buffer */
+static bool read_record(int fd, uint32_t off, uint32_t len, const char *key,
+                        uint32_t hash, char **data, size_t *size)
+{
+    size_t keylen = strlen(key);
+    disk_record rec;
+    char *buf = malloc(len);
+
+    if (buf == NULL || pread(fd, buf, len, off) != (ssize_t)len) {
+        free(buf);
+        return false;
+    }
+    memcpy(&rec, buf, sizeof(rec));
+    if (rec.magic != DISK_MAGIC || rec.hash != hash || rec.keylen != keylen
+        || sizeof(rec) + keylen + rec.size != len
+        || memcmp(buf + sizeof(rec), key, keylen)) {
+        free(buf);
+        return false;
+    }
+    memmove(buf, buf + sizeof(rec) + keylen, rec.size);
+    if (checksum(buf, rec.size) != rec.sum) {
+        free(buf);
+        return false;
+    }
+    *data = buf;
+    *size = rec.size;
+    return true;
+}
+
+bool disk_get(const char *key, unsigned int hash, char **data, size_t *size)
+{
+    disk_slot *s;
+    disk_seg *seg;
+    bool found = false;
+
+    if (!opened) {
+        return false;
+    }
+    pthread_rwlock_rdlock(&index_lock);
+    s = slot_find(hash, second_hash(key));
+    if (s->len != 0 && (seg = seg_find(s->seg)) != NULL) {
+        found = read_record(seg->fd, s->off, s->len, key, hash, data, size);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+static void wake_compactor(void)
+{
+    pthread_mutex_lock(&compact_lock);
+    pthread_cond_signal(&compact_wake);
+    pthread_mutex_unlock(&compact_lock);
+}
+
+/* seal the head and start a new one; caller holds append_lock */
+static bool roll(void)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    pthread_rwlock_wrlock(&index_lock);
+    if (nsegs == DISK_MAX_SEGS) {
+        pthread_rwlock_unlock(&index_lock);
+        wake_compactor();
+        return false;
+    }
+    seg_path(path, sizeof(path), idx->next_seg);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        pthread_rwlock_unlock(&index_lock);
+        return false;
+    }
+    head_id = idx->next_seg++;
+    segs[nsegs].id = head_id;
+    segs[nsegs].fd = fd;
+    segs[nsegs].size = segs[nsegs].live = 0;
+    nsegs++;
+    pthread_rwlock_unlock(&index_lock);
+
+    head_fd = fd;
+    head_size = 0;
+    wake_compactor();
+    return true;
+}
+
+/* append len bytes in iov to the head, and return where they went in
+*off; caller holds append_lock */
+static bool append(const struct iovec *iov, int iovcnt, size_t len, uint32_t *off)
+{
+    if ((head_fd < 0 || head_size + len > DISK_SEG_SIZE) && !roll()) {
+        return false;
+    }
+    /* a short write leaves bytes past head_size that the next overwrites */
+    if (pwritev(head_fd, iov, iovcnt, head_size) != (ssize_t)len) {
+        return false;
+    }
+    *off = head_size;
+    head_size += len;
+    return true;
+}
+
+/* point the index at the record just appended at off. A copy made by the
+compactor only replaces the entry it was copied from (was); if that entry
+changed meanwhile, the copy is dead. Caller holds append_lock */
+static void publish(uint32_t hash, uint32_t hash2, uint32_t off, uint32_t len,
+                    const disk_slot *was)
+{
+    pthread_rwlock_wrlock(&index_lock);
+    disk_seg *head = seg_find(head_id);
+    disk_slot *s = slot_find(hash, hash2);
+    head->size = off + len;
+    if (was != NULL && (s->len == 0 || s->seg != was->seg || s->off != was->off)) {
+        pthread_rwlock_unlock(&index_lock);
+        return;
+    }
+    if (s->len != 0) {
+        disk_seg *old = seg_find(s->seg);
+        if (old != NULL) {
+            old->live -= s->len;
+        }
+    } else if (idx->count == DISK_MAX_ENTRIES) {
+        pthread_rwlock_unlock(&index_lock);
+        wake_compactor();
+        return;
+    } else {
+        idx->count++;
+    }
+    s->hash = hash;
+    s->hash2 = hash2;
+    s->seg = head_id;
+    s->off = off;
+    s->len = len;
+    head->live += len;
+    pthread_rwlock_unlock(&index_lock);
+}
+
+/* append the object w describes and point the index at it */
+static void write_object(const disk_write *w)
+{
+    disk_record rec;
+    struct iovec iov[3];
+    size_t len;
+    uint32_t off;
+
+    rec.keylen = strlen(w->key);
+    len = sizeof(rec) + rec.keylen + w->size;
+    rec.magic = DISK_MAGIC;
+    rec.hash = w->hash;
+    rec.size = w->size;
+    rec.sum = checksum(w->data, w->size);
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (char *)w->key;
+    iov[1].iov_len = rec.keylen;
+    iov[2].iov_base = (char *)w->data;
+    iov[2].iov_len = w->size;
+
+    pthread_mutex_lock(&append_lock);
+    if (append(iov, 3, len, &off)) {
+        publish(w->hash, second_hash(w->key), off, len, NULL);
+    }
+    pthread_mutex_unlock(&append_lock);
+}
+
+void disk_put(const char *key, unsigned int hash, const char *data, size_t size,
+              void (*done)(void *arg), void *arg)
+{
+    bool queued = false;
+
+    if (opened && sizeof(disk_record) + strlen(key) + size <= DISK_SEG_SIZE) {
+        pthread_mutex_lock(&compact_lock);
+        if (writes_len < DISK_QUEUE) {
+            disk_write *w = &writes[(writes_head + writes_len++) % DISK_QUEUE];
+            w->key = key;
+            w->hash = hash;
+            w->data = data;
+            w->size = size;
+            w->done = done;
+            w->arg = arg;
+            pthread_cond_signal(&compact_wake);
+            queued = true;
+        }
+        pthread_mutex_unlock(&compact_lock);
+    }
+    if (!queued && done != NULL) {
+        done(arg);
+    }
+}
+
+/* look up q and hand it back to whoever watches disk_fd() */
+static void answer_query(disk_query *q)
+{
+    char c = 0;
+
+    if (!disk_get(q->key, q->hash, &q->data, &q->size)) {
+        q->data = NULL;
+    }
+    q->next = NULL;
+    pthread_mutex_lock(&compact_lock);
+    if (done_tail != NULL) {
+        done_tail->next = q;
+    } else {
+        done_head = q;
+    }
+    done_tail = q;
+    pthread_mutex_unlock(&compact_lock);
+    if (write(notify[1], &c, 1) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "disk: notify failed: %s\n", strerror(errno));
+    }
+}
+
+/* carry out everything queued so far, lookups before writes; only the
+background thread calls this */
+static void drain_queue(void)
+{
+    while (1) {
+        disk_query *q = NULL;
+        disk_write w;
+        pthread_mutex_lock(&compact_lock);
+        if (reads_head != NULL) {
+            q = reads_head;
+            if ((reads_head = q->next) == NULL) {
+                reads_tail = NULL;
+            }
+            reads_len--;
+        } else if (writes_len > 0) {
+            w = writes[writes_head];
+            writes_head = (writes_head + 1) % DISK_QUEUE;
+            writes_len--;
+        } else {
+            pthread_mutex_unlock(&compact_lock);
+            return;
+        }
+        pthread_mutex_unlock(&compact_lock);
+
+        if (q != NULL) {
+            answer_query(q);
+            continue;
+        }
+        write_object(&w);
+        if (w.done != NULL) {
+            w.done(w.arg);
+        }
+    }
+}
+
+disk_query *disk_submit(const char *key, unsigned int hash, void *arg)
+{
+    disk_query *q;
+
+    if (!opened || (q = calloc(1, sizeof(disk_query))) == NULL) {
+        return NULL;
+    }
+    if ((q->key = strdup(key)) == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->hash = hash;
+    q->arg = arg;
+
+    pthread_mutex_lock(&compact_lock);
+    if (reads_len == DISK_QUEUE) {
+        pthread_mutex_unlock(&compact_lock);
+        disk_query_free(q);
+        return NULL;
+    }
+    if (reads_tail != NULL) {
+        reads_tail->next = q;
+    } else {
+        reads_head = q;
+    }
+    reads_tail = q;
+    reads_len++;
+    pthread_cond_signal(&compact_wake);
+    pthread_mutex_unlock(&compact_lock);
+    return q;
+}
+
+int disk_fd(void)
+{
+    return opened ? notify[0] : -1;
+}
+
+disk_query *disk_done(void)
+{
+    char drain[64];
+    disk_query *q;
+
+    /* empty the pipe first: a query finishing after this still wakes us */
+    while (read(notify[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&compact_lock);
+    q = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&compact_lock);
+    return q;
+}
+
+void disk_cancel(disk_query *q)
+{
+    q->arg = NULL;
+}
+
+void disk_query_free(disk_query *q)
+{
+    free(q->data);
+    free(q->key);
+    free(q);
+}
+
+/* forget segment id and every entry pointing into it, and delete its file.
+Only the compaction thread calls this */
+static void drop_seg(uint32_t id)
+{
+    char path[PATH_MAX];
+    int fd = -1;
+
+    pthread_rwlock_wrlock(&index_lock);
+    for (uint32_t i = 0; i < DISK_SLOTS;) {
+        if (idx->slots[i].len != 0 && idx->slots[i].seg == id) {
+            slot_delete(i); /* an entry may have moved into i: look again */
+        } else {
+            i++;
+        }
+    }
+    for (int i = 0; i < nsegs; i++) {
+        if (segs[i].id == id) {
+            fd = segs[i].fd;
+            memmove(&segs[i], &segs[i + 1], (nsegs - i - 1) * sizeof(disk_seg));
+            nsegs--;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    close(fd);
+    seg_path(path, sizeof(path), id);
+    unlink(path);
+}
+
+/* copy the records still live in segment id to the head, then drop it */
+static void compact_seg(uint32_t id)
+{
+    for (uint32_t i = 0; i < DISK_SLOTS; i++) {
+        disk_slot s;
+        int fd = -1;
+
+        pthread_rwlock_rdlock(&index_lock);
+        s = idx->slots[i];
+        if (s.len != 0 && s.seg == id) {
+            fd = seg_find(id)->fd;
+        }
+        pthread_rwlock_unlock(&index_lock);
+        if (fd < 0) {
+            continue;
+        }
+
+        /* only this thread closes segments, so fd stays good */
+        char *buf = malloc(s.len);
+        struct iovec iov;
+        uint32_t off;
+        if (buf != NULL && pread(fd, buf, s.len, s.off) == (ssize_t)s.len) {
+            iov.iov_base = buf;
+            iov.iov_len = s.len;
+            pthread_mutex_lock(&append_lock);
+            if (append(&iov, 1, s.len, &off)) {
+                publish(s.hash, s.hash2, off, s.len, &s);
+            }
+            pthread_mutex_unlock(&append_lock);
+        }
+        free(buf);
+    }
+    drop_seg(id);
+}
+
+/* the segment to drop to get back under budget (the oldest), or to compact
+(the one with the least live data, if under half); never the head */
+static bool pick_seg(bool oldest, uint32_t *id)
+{
+    size_t total = 0;
+    double best = 0.5;
+    bool found = false;
+
+    pthread_rwlock_rdlock(&index_lock);
+    for (int i = 0; i < nsegs; i++) {
+        total += segs[i].size;
+    }
+    for (int i = 0; i < nsegs && segs[i].id != head_id; i++) {
+        double ratio = (double)segs[i].live / (segs[i].size > 0 ? segs[i].size : 1);
+        if (oldest) {
+            found = total > DISK_MAX_SIZE || idx->count >= DISK_MAX_ENTRIES
+                    || nsegs == DISK_MAX_SEGS;
+            *id = segs[i].id;
+            break;
+        }
+        if (ratio < best) {
+            best = ratio;
+            *id = segs[i].id;
+            found = true;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+static void *compactor(void *vargp)
+{
+    pthread_detach(pthread_self());
+    while (1) {
+        struct timespec until;
+        uint32_t id;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += DISK_COMPACT_SECS;
+        pthread_mutex_lock(&compact_lock);
+        if (writes_len == 0 && reads_head == NULL) {
+            pthread_cond_timedwait(&compact_wake, &compact_lock, &until);
+        }
+        pthread_mutex_unlock(&compact_lock);
+
+        drain_queue();
+        while (pick_seg(true, &id)) {
+            drop_seg(id);
+        }
+        while (pick_seg(false, &id)) {
+            compact_seg(id);
+            drain_queue(); /* a compaction may take a while */
+        }
+    }
+    return NULL;
+}
+
+static int seg_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const disk_seg *)a)->id, y = ((const disk_seg *)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+/* open the segment files in disk_dir, oldest first */
+static int open_segs(void)
+{
+    DIR *d = opendir(disk_dir);
+    struct dirent *e;
+
+    if (d == NULL) {
+        return -1;
+    }
+    while ((e = readdir(d)) != NULL && nsegs < DISK_MAX_SEGS) {
+        char path[PATH_MAX];
+        unsigned int id;
+        int end = 0;
+        struct stat st;
+        if (sscanf(e->d_name, "%8x.seg%n", &id, &end) != 1
+            || end != (int)strlen(e->d_name) || id == 0) {
+            continue;
+        }
+        seg_path(path, sizeof(path), id);
+        int fd = open(path, O_RDWR);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        segs[nsegs].id = id;
+        segs[nsegs].fd = fd;
+        segs[nsegs].size = st.st_size;
+        segs[nsegs].live = 0;
+        nsegs++;
+    }
+    closedir(d);
+    qsort(segs, nsegs, sizeof(disk_seg), seg_cmp);
+    return 0;
+}
+
+int disk_init(const char *dir)
+{
+    size_t size = sizeof(disk_index) + DISK_SLOTS * sizeof(disk_slot);
+    char path[PATH_MAX];
+    struct stat st;
+    pthread_t tid;
+    int fd;
+
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST)
+        || (disk_dir = strdup(dir)) == NULL) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/index", dir);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return -1;
+    }
+    bool fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != size;
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+        close(fd);
+        return -1;
+    }
+    idx = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (idx == MAP_FAILED) {
+        return -1;
+    }
+    if (fresh || memcmp(idx->magic, index_magic, sizeof(index_magic))
+        || idx->nslots != DISK_SLOTS) {
+        memset(idx, 0, size);
+        memcpy(idx->magic, index_magic, sizeof(index_magic));
+        idx->nslots = DISK_SLOTS;
+        idx->next_seg = 1;
+    }
+    if (open_segs() < 0) {
+        return -1;
+    }
+    if (nsegs > 0 && idx->next_seg <= segs[nsegs - 1].id) {
+        idx->next_seg = segs[nsegs - 1].id + 1;
+    }
+
+    /* the index may have been written after segments it points into went
+    away (or before a crash lost their end): forget those entries, then
+    count what the rest keep alive */
+    for (uint32_t i = 0; i < DISK_SLOTS;) {
+        disk_slot *s = &idx->slots[i];
+        disk_seg *seg;
+        if (s->len != 0
+            && ((seg = seg_find(s->seg)) == NULL
+                || (size_t)s->off + s->len > seg->size)) {
+            slot_delete(i); /* an entry may have moved into i: look again */
+        } else {
+            i++;
+        }
+    }
+    idx->count = 0;
+    for (uint32_t i = 0; i < DISK_SLOTS; i++) {
+        if (idx->slots[i].len != 0) {
+            seg_find(idx->slots[i].seg)->live += idx->slots[i].len;
+            idx->count++;
+        }
+    }
+
+    if (pipe(notify) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify[i], F_SETFL, fcntl(notify[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+    opened = true;
+    pthread_create(&tid, NULL, compactor, NULL);
+    return idx->count;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file disk.h
+ * @brief Second cache tier on disk, behind the in-memory cache
+ *
+ * The memory cache holds MAX_CACHE_SIZE bytes and is empty after every
+ * restart. With -D the proxy also writes every response it caches to a
+ * directory, and a lookup that misses in memory looks there before going
+ * to the origin; what it finds is put back into memory. The writes are
+ * queued for a background thread, so a miss never waits for the disk.
+ * Worker threads read it themselves with disk_get(). The event loop must not
+ * block, so it hands its lookups to the same background thread with
+ * disk_submit() and learns about finished ones through a pipe it watches,
+ * as it does with the resolver.
+ *
+ * Objects are appended to a log of segment files, DISK_SEG_SIZE bytes each,
+ * and found through a hash index kept in a file mapped into memory. The
+ * index needs no loading: a restarted proxy maps it and serves hits from
+ * the segments straight away. The background thread that writes objects
+ * also drops the oldest segments when the log outgrows DISK_MAX_SIZE, and
+ * rewrites segments that are mostly dead (objects written again since)
+ * into the newest one.
+ *
+ * Nothing is fsync()ed. Every record carries a checksum, so after a crash
+ * the index may point at objects that were lost, and those are misses, but
+ * never at half-written ones.
+ */
+
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DISK_SEG_SIZE (4 * 1024 * 1024)    /* bytes in a full segment */
+#define DISK_MAX_SIZE (256 * 1024 * 1024)  /* the log is kept below this */
+#define DISK_SLOTS (1 << 16)  /* index entries; at most 3/4 are used */
+#define DISK_COMPACT_SECS 1   /* how often the log is looked after */
+#define DISK_QUEUE 64         /* writes (and lookups) waiting; more are
+                                 dropped */
+
+/* Open (or create) the disk tier in dir and start its background thread.
+Returns the number of objects found there, or -1 with errno set */
+int disk_init(const char *dir);
+
+/* The object stored under key (whose cache_hash() is hash): true with a
+malloc()ed copy in *data and its length in *size, false if the disk tier is
+not open or does not have it */
+bool disk_get(const char *key, unsigned int hash, char **data, size_t *size);
+
+/* Store size bytes of data under key, replacing what was there, on the
+background thread: key and data must stay as they are until done(arg) is
+called, which may be straight away. Lookups miss the object until it is
+written. Does nothing if the disk tier is not open, and drops the object if
+DISK_QUEUE writes are waiting already, the index is full or writing fails:
+the disk is only a cache */
+void disk_put(const char *key, unsigned int hash, const char *data, size_t size,
+              void (*done)(void *arg), void *arg);
+
+/* a lookup run by the background thread */
+typedef struct disk_query {
+    char *key;
+    unsigned int hash;
+    void *arg;        /* the submitter's, NULL once cancelled */
+    char *data;       /* what disk_get() found (malloc()ed), NULL if not */
+    size_t size;
+    struct disk_query *next;
+} disk_query;
+
+/* disk_get() on the background thread, ahead of the writes waiting there.
+NULL if the disk tier is not open, DISK_QUEUE lookups are waiting already or
+out of memory; otherwise the query comes back from disk_done() once read */
+disk_query *disk_submit(const char *key, unsigned int hash, void *arg);
+
+/* The descriptor that becomes readable when queries are done, -1 if the
+disk tier is not open */
+int disk_fd(void);
+
+/* The queries finished since the last call, oldest first, linked through
+next; the caller frees each with disk_query_free(), which frees data unless
+the caller took it and set it to NULL */
+disk_query *disk_done(void);
+
+/* Forget about a submitted query: it still completes, with arg NULL. Only
+the thread that submits and collects queries may call this */
+void disk_cancel(disk_query *q);
+
+void disk_query_free(disk_query *q);
+
+#endif /* DISK_H */
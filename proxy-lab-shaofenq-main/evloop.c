@@ -0,0 +1,1425 @@
+/*
+ * evloop.c - epoll event loop for the proxy
+ *
+ * A client connection (ev_conn) reads requests and queues one ev_req for
+ * each, so a persistent client can pipeline several. Every request walks
+ * through the same steps as serve_request() in proxy.c, but never blocks on
+ * a socket or the disk:
+ *
+ *   EV_DISK          with -D, a key missing from memory is looked up in the
+ *                    disk tier by its background thread (disk.c); what it
+ *                    finds is served like a hit, otherwise we fetch
+ *   EV_RESOLVE       a resolver thread looks up an origin name that is not
+ *                    in the resolver cache (resolver.c); with -k an idle
+ *                    pooled connection skips this and the next step
+ *   EV_CONNECT       non-blocking connect()s to the origin's addresses,
+ *                    raced with staggered starts (conn.c); the first to
+ *                    connect is kept, and the race gives up after -t
+ *   EV_SEND_REQUEST  write the rewritten request to the origin
+ *   EV_RELAY         pass the response from the origin to the client. Reads
+ *                    land in the response's cache_pending buffer and are
+ *                    written to the client from there, which is cached once
+ *                    the response is complete. Once a response can no
+ *                    longer be cached the rest is spliced through a pipe
+ *                    owned by the request and never enters user space
+ *   EV_SERVE_HIT     write a cached block to the client; the request holds
+ *                    a reference to the block instead of a copy
+ *   EV_WAIT_FILL     with -s, a miss on a key another request is already
+ *                    fetching parks here until that fetch ends, then is
+ *                    served from the cache or fetches on its own
+ *
+ * All requests of a connection make progress at once, but only the oldest
+ * one writes to the client, so responses go out in request order. The
+ * others keep reading their origin while there is room that holds no
+ * unsent bytes and then wait for their turn, so a hit queued behind a slow
+ * miss is ready the moment the miss is done. When the client cannot keep
+ * up we stop reading the origin until the pending bytes are flushed.
+ *
+ * A response is framed (upstream.c) when the client or, with -k, the origin
+ * connection is to be reused, so we know where it ends without waiting for
+ * EOF, and when it answers a conditional GET for a stale cached block: its
+ * head is held until the status is known, and on a 304 the stale block is
+ * served instead, fresh again. A keep-alive client gets the response head with our own Connection
+ * header in place of the origin's; a connection left idle for
+ * config.client_idle seconds is closed.
+ *
+ * A request, its strings, its header table and the request for the origin
+ * all come from the connection's arena (arena.c). Nothing is freed when a
+ * request is done; the arena is reset once the connection has no request
+ * left, and a connection whose arena fills up stops taking requests until
+ * then, so a client that always keeps one in flight cannot grow it without
+ * bound.
+ *
+ * The epoll interest set is level triggered. Every socket points back at
+ * its connection and request through an ev_side, so an event tells us what
+ * it belongs to and which end became ready.
+ */
+
+#define _GNU_SOURCE /* splice() */
+
+#include "arena.h"
+#include "cache.h"
+#include "conn.h"
+#include "csapp.h"
+#include "disk.h"
+#include "evloop.h"
+#include "proxy.h"
+#include "refresh.h"
+#include "request.h"
+#include "resolver.h"
+#include "stats.h"
+#include "upstream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define EV_MAXEVENTS 256
+#define EV_PIPE_SIZE 65536
+#define EV_PIPELINE_MAX 16 /* requests a connection may have in flight */
+/* no more requests are taken while a connection's arena holds this much;
+enough for a full pipeline of misses */
+#define EV_ARENA_MAX (EV_PIPELINE_MAX * 3 * MAXLINE / 2)
+
+typedef enum {
+    EV_DISK,
+    EV_RESOLVE,
+    EV_CONNECT,
+    EV_SEND_REQUEST,
+    EV_RELAY,
+    EV_SERVE_HIT,
+    EV_WAIT_FILL
+} ev_state;
+
+struct ev_conn;
+struct ev_req;
+
+/* an origin fetch other requests are waiting on (single-flight) */
+typedef struct ev_flight {
+    char *key;
+    unsigned int hash;
+    struct ev_req *waiters;
+    struct ev_flight *next;
+} ev_flight;
+
+/* One socket as registered with epoll: the client of a connection, or the
+origin of one of its requests (req is NULL for the client) */
+typedef struct ev_side {
+    struct ev_conn *conn;
+    struct ev_req *req;
+    int fd;
+    bool added;      /* in the interest set */
+    uint32_t events; /* what it is registered for */
+} ev_side;
+
+typedef struct ev_req {
+    ev_state state;
+    struct ev_conn *conn;
+    ev_side origin;
+    disk_query *disk;       /* disk tier lookup in progress in EV_DISK */
+    resolver_query *query;  /* lookup in progress in EV_RESOLVE */
+    conn_race race;         /* connect attempts in EV_CONNECT */
+    ev_side attempt[RESOLVER_MAXADDRS]; /* their sockets, as race.fd[] */
+    struct ev_req *race_prev, *race_next; /* racing list, for the timers */
+    unsigned long connect_start; /* CLOCK_MONOTONIC ns the lookup began */
+    char *buf;              /* the client's request head, then relay
+                               data that cannot be cached; a miss only */
+    struct iovec *req;      /* the request for the origin, mostly pointing
+                               into buf */
+    int reqcnt;
+    char *out;              /* response bytes not yet written: in buf,
+                               pending or the hit, NULL if in the pipe */
+    size_t len;             /* valid bytes at out (or of the request
+                               while sending it) */
+    size_t off;             /* bytes of them already written */
+    struct iovec head[RESPONSE_IOV_MAX]; /* rewritten head, not yet written */
+    int headcnt;
+    bool head_done;         /* the head is sent as is or sits in head[] */
+    bool keepalive;         /* the client keeps the connection after this */
+    bool complete;          /* the whole response is in, nothing to read */
+    int pipefd[2];          /* splice() relay, opened once it is needed */
+    bool copy;              /* splice() unusable, relay through user space */
+    bool reused;            /* origin socket came from the keep-alive pool */
+    size_t received;        /* response bytes read from the origin */
+    upstream_framing framing; /* where the response ends, when framed */
+    cache_block *hit;       /* block being served in EV_SERVE_HIT */
+    cache_block *stale;     /* stale block the fetch asks the origin about */
+    bool conditional;       /* the client asked a conditional GET itself */
+    char *key;              /* cache key of a cacheable miss */
+    cache_pending pending;  /* response so far, kept while it may be cached */
+    relay_stats stats;      /* what the response cost, for the -v log */
+    bool report;            /* answers STATS_PATH, rendered to out once
+                               it is the oldest; nothing to log */
+    char *host;             /* origin, kept for a fetch started later */
+    char *port;
+    ev_flight *flight;      /* fetch this request leads */
+    ev_flight *waiting_on;  /* fetch this request is parked on */
+    struct ev_req *next_waiter;
+    bool closed;
+    struct ev_req *next_req; /* connection's queue, then the dead list */
+} ev_req;
+
+typedef struct ev_conn {
+    ev_side client;
+    char *in;               /* request bytes not yet handled */
+    size_t inlen;
+    request_parser parser;  /* the head at in, as far as it has come */
+    ev_req *head, *tail;    /* requests in flight, oldest first */
+    int nreqs;
+    int unreaped;           /* requests done but not yet off the dead list */
+    arena arena;            /* the requests and everything they point to,
+                               reset once none is left */
+    bool keepalive;         /* more requests may follow */
+    bool held;              /* requests may be waiting in "in" for room */
+    bool eof;               /* the client has sent everything */
+    bool idle;              /* on the idle list */
+    unsigned long idle_since; /* CLOCK_MONOTONIC ms */
+    struct ev_conn *idle_prev, *idle_next;
+    bool closed;
+    struct ev_conn *next_dead;
+} ev_conn;
+
+static int epfd;
+
+#define EV_FLIGHT_BUCKETS 256
+static ev_flight *flights[EV_FLIGHT_BUCKETS];
+
+static void flight_end(ev_flight *f);
+static void conn_pump(ev_conn *c);
+
+/* connections and requests closed during the current batch of events;
+freed once the batch is done so a later event in the same batch never
+touches freed memory */
+static ev_conn *dead_conns;
+static ev_req *dead_reqs;
+
+/* connections with no request in flight, longest idle first */
+static ev_conn *idle_head, *idle_tail;
+
+/* requests in EV_CONNECT, whose races have timers to run */
+static ev_req *racing;
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* register side for events; with none it leaves the interest set, as a
+parked socket would otherwise keep reporting a hangup */
+static void ev_watch(ev_side *side, uint32_t events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (side->added && side->events == events) {
+        return;
+    }
+    if (events == 0) {
+        if (side->added) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, side->fd, NULL);
+            side->added = false;
+        }
+        return;
+    }
+    op = side->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ev.events = events;
+    ev.data.ptr = side;
+    if (epoll_ctl(epfd, op, side->fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        return;
+    }
+    side->added = true;
+    side->events = events;
+}
+
+/* closing the socket also takes it out of the interest set */
+static void side_close(ev_side *side)
+{
+    if (side->fd >= 0) {
+        close(side->fd);
+    }
+    side->fd = -1;
+    side->added = false;
+}
+
+static void idle_add(ev_conn *c)
+{
+    c->idle = true;
+    c->idle_since = now_ms();
+    c->idle_next = NULL;
+    c->idle_prev = idle_tail;
+    if (idle_tail != NULL) {
+        idle_tail->idle_next = c;
+    } else {
+        idle_head = c;
+    }
+    idle_tail = c;
+}
+
+static void idle_remove(ev_conn *c)
+{
+    if (!c->idle) {
+        return;
+    }
+    c->idle = false;
+    if (c->idle_prev != NULL) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        idle_head = c->idle_next;
+    }
+    if (c->idle_next != NULL) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        idle_tail = c->idle_prev;
+    }
+}
+
+/* the request is off the racing list: it connected or is being closed */
+static void race_end(ev_req *r)
+{
+    if (r->race_prev != NULL) {
+        r->race_prev->race_next = r->race_next;
+    } else {
+        racing = r->race_next;
+    }
+    if (r->race_next != NULL) {
+        r->race_next->race_prev = r->race_prev;
+    }
+}
+
+/* let go of everything a request holds; its memory is in the connection's
+arena, which is not reset before the batch is done */
+static void req_free(ev_req *r)
+{
+    r->closed = true;
+    if (r->flight != NULL) {
+        flight_end(r->flight);
+        r->flight = NULL;
+    }
+    if (r->waiting_on != NULL) {
+        ev_req **pp = &r->waiting_on->waiters;
+        while (*pp != r) {
+            pp = &(*pp)->next_waiter;
+        }
+        *pp = r->next_waiter;
+    }
+    if (r->disk != NULL) {
+        disk_cancel(r->disk);
+    }
+    if (r->query != NULL) {
+        resolver_cancel(r->query);
+    }
+    if (r->state == EV_CONNECT) {
+        race_end(r);
+        conn_race_abort(&r->race);
+    }
+    side_close(&r->origin);
+    if (r->pipefd[0] >= 0) {
+        close(r->pipefd[0]);
+        close(r->pipefd[1]);
+    }
+    if (r->hit) {
+        cache_release(r->hit);
+    }
+    if (r->stale != NULL) {
+        cache_release(r->stale);
+    }
+    cache_pending_abort(&r->pending);
+    r->conn->unreaped++;
+    r->next_req = dead_reqs;
+    dead_reqs = r;
+}
+
+static void conn_close(ev_conn *c)
+{
+    if (c->closed) {
+        return;
+    }
+    c->closed = true;
+    stats_count(STAT_CLIENTS_CLOSED, 1);
+    idle_remove(c);
+    while (c->head != NULL) {
+        ev_req *r = c->head;
+        c->head = r->next_req;
+        req_free(r);
+    }
+    side_close(&c->client);
+    free(c->in);
+    c->next_dead = dead_conns;
+    dead_conns = c;
+}
+
+static void reap_dead(void)
+{
+    while (dead_reqs) {
+        ev_req *r = dead_reqs;
+        ev_conn *c = r->conn;
+        dead_reqs = r->next_req;
+        if (--c->unreaped == 0 && !c->closed && c->nreqs == 0
+            && c->arena.used >= EV_ARENA_MAX) {
+            conn_pump(c); /* stopped reading for a full arena: reset it */
+        }
+    }
+    while (dead_conns) {
+        ev_conn *c = dead_conns;
+        dead_conns = c->next_dead;
+        arena_free(&c->arena);
+        free(c);
+    }
+}
+
+/* close the connections that sat idle for config.client_idle seconds */
+static void expire_idle(void)
+{
+    unsigned long now = now_ms();
+    while (idle_head != NULL
+           && now - idle_head->idle_since
+                  >= (unsigned long)config.client_idle * 1000) {
+        conn_close(idle_head);
+    }
+}
+
+static void accept_clients(int listenfd)
+{
+    while (1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        set_nonblocking(connfd);
+
+        ev_conn *c = calloc(1, sizeof(ev_conn));
+        if (c == NULL || (c->in = malloc(MAXLINE)) == NULL) {
+            free(c);
+            close(connfd);
+            continue;
+        }
+        c->in[0] = '\0';
+        arena_init(&c->arena);
+        request_parser_init(&c->parser, &c->arena);
+        c->client.conn = c;
+        c->client.fd = connfd;
+        c->keepalive = true;
+        stats_count(STAT_CLIENTS_OPENED, 1);
+        if (config.client_idle > 0) {
+            idle_add(c);
+        }
+        ev_watch(&c->client, EPOLLIN);
+    }
+}
+
+/* start the attempts that are due and watch their sockets; the request
+fails once its race is lost */
+static void race_poll(ev_req *r)
+{
+    if (!conn_race_poll(&r->race)) {
+        sio_printf("connection to server failed.\n");
+        conn_close(r->conn);
+        return;
+    }
+    for (int i = 0; i < r->race.addrs.count; i++) {
+        ev_side *side = &r->attempt[i];
+        if (r->race.fd[i] < 0) {
+            side->fd = -1; /* never started, or closed by conn.c */
+            side->added = false;
+        } else if (!side->added) {
+            side->conn = r->conn;
+            side->req = r;
+            side->fd = r->race.fd[i];
+            ev_watch(side, EPOLLOUT);
+        }
+    }
+}
+
+/* the lookup gave res, unless rc says it failed: connect to one of them */
+static void origin_resolved(ev_req *r, int rc, const resolver_result *res)
+{
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", r->host, r->port,
+                gai_strerror(rc));
+        conn_close(r->conn);
+        return;
+    }
+    conn_race_start(&r->race, res);
+    r->state = EV_CONNECT;
+    r->race_prev = NULL;
+    r->race_next = racing;
+    if (racing != NULL) {
+        racing->race_prev = r;
+    }
+    racing = r;
+    race_poll(r);
+}
+
+/* resolve the origin and start a new connection to it; a name that is not
+cached is looked up in the background */
+static void resolve_origin(ev_req *r)
+{
+    resolver_result res;
+    int rc;
+
+    r->reused = false;
+    r->stats.connects++;
+    r->connect_start = now_ns();
+    if (resolver_cached(r->host, r->port, &res, &rc)) {
+        origin_resolved(r, rc, &res);
+        return;
+    }
+    if ((r->query = resolver_submit(r->host, r->port, r)) == NULL) {
+        conn_close(r->conn);
+        return;
+    }
+    r->state = EV_RESOLVE;
+}
+
+/* lookups have finished: carry on with the requests still waiting */
+static void on_resolved(void)
+{
+    resolver_query *q = resolver_done();
+    while (q != NULL) {
+        resolver_query *next = q->next;
+        ev_req *r = q->arg;
+        if (r != NULL) {
+            r->query = NULL;
+            origin_resolved(r, q->rc, &q->res);
+        }
+        resolver_query_free(q);
+        q = next;
+    }
+}
+
+/* bytes of the request for the origin */
+static size_t request_len(const ev_req *r)
+{
+    size_t len = 0;
+    for (int i = 0; i < r->reqcnt; i++) {
+        len += r->req[i].iov_len;
+    }
+    return len;
+}
+
+/* start fetching the response; the request is ready in req[] */
+static void start_fetch(ev_req *r)
+{
+    cache_pending_init(&r->pending, r->key != NULL);
+    if (r->stale != NULL) {
+        /* ask only for something newer than the stale block, and hold the
+        head until its status says whether that is what came */
+        r->reqcnt = request_iov_validators(r->req, r->reqcnt, r->stale);
+        r->len = request_len(r);
+        r->head_done = false;
+    }
+    if (config.keepalive > 0
+        && (r->origin.fd = upstream_take(r->host, r->port)) >= 0) {
+        r->reused = true;
+        r->state = EV_SEND_REQUEST;
+        ev_watch(&r->origin, EPOLLOUT);
+        return;
+    }
+    resolve_origin(r);
+}
+
+/* a pooled connection turned out to be closed by the origin before any of
+the response came back: send the request again on a new one. buf still
+holds the request, nothing has been read over it yet */
+static void refetch(ev_req *r)
+{
+    side_close(&r->origin);
+    r->len = request_len(r);
+    r->off = 0;
+    resolve_origin(r);
+}
+
+/* the whole response is in: with -k, pool the origin socket if it may be
+reused */
+static void release_origin(ev_req *r)
+{
+    r->complete = true;
+    if (config.keepalive > 0 && r->framing.keepalive) {
+        ev_watch(&r->origin, 0);
+        upstream_put(r->host, r->port, r->origin.fd);
+        r->origin.fd = -1;
+    } else {
+        side_close(&r->origin);
+    }
+}
+
+/* b if r may be answered with it: it is still fresh, or stale with a
+refresh worker (-r) fetching it again. Otherwise a stale block with a
+validator is kept in r->stale, as serve_request() does, so the fetch asks
+the origin about it with a conditional GET; without one, or when the client
+asked a conditional question of its own, it is released and fetched again
+in full. Either way what the origin sends instead replaces it */
+static cache_block *usable(ev_req *r, cache_block *b)
+{
+    if (b != NULL && (cache_fresh(b) || refresh_stale(b))) {
+        if (r->stale != NULL) {
+            cache_release(r->stale);
+            r->stale = NULL;
+        }
+        return b;
+    }
+    if (b != NULL) {
+        if (r->stale == NULL && !r->conditional
+            && (b->etag != NULL || b->last_modified != NULL)) {
+            r->stale = b;
+        } else {
+            cache_release(b);
+        }
+    }
+    return NULL;
+}
+
+/* the cached block for r, if usable(); the disk tier is not asked here,
+that takes a disk_submit() */
+static cache_block *lookup_fresh(ev_req *r, const char *key)
+{
+    return usable(r, cache_lookup_memory(key));
+}
+
+/* answer r from a cached block */
+static void serve_hit(ev_req *r, cache_block *b)
+{
+    r->hit = b;
+    r->state = EV_SERVE_HIT;
+    r->complete = true;
+    r->head_done = true;
+    r->out = b->data;
+    r->len = b->size;
+    r->off = 0;
+    if (!r->keepalive) {
+        return;
+    }
+    /* the client stays: it needs a length and our own Connection header */
+    upstream_framing f;
+    upstream_framing_init(&f);
+    upstream_frame(&f, b->data, b->size);
+    if (upstream_frame_done(&f)
+        && (r->headcnt = response_head_iov(b->data, f.head_len, r->head,
+                                           RESPONSE_IOV_MAX)) > 0) {
+        r->out += f.head_len;
+        r->len -= f.head_len;
+    } else {
+        r->headcnt = 0;
+        r->keepalive = false;
+        r->conn->keepalive = false;
+    }
+}
+
+static ev_flight *flight_find(const char *key)
+{
+    unsigned int hash = cache_hash(key);
+    ev_flight *f;
+    for (f = flights[hash % EV_FLIGHT_BUCKETS]; f != NULL; f = f->next) {
+        if (f->hash == hash && !strcmp(f->key, key)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static ev_flight *flight_start(const char *key)
+{
+    ev_flight *f = calloc(1, sizeof(ev_flight));
+    if (f == NULL || (f->key = strdup(key)) == NULL) {
+        free(f);
+        return NULL;
+    }
+    f->hash = cache_hash(key);
+    f->next = flights[f->hash % EV_FLIGHT_BUCKETS];
+    flights[f->hash % EV_FLIGHT_BUCKETS] = f;
+    return f;
+}
+
+/* the leading fetch is over: its waiters are served from the cache if it
+got there, otherwise each fetches on its own */
+static void flight_end(ev_flight *f)
+{
+    ev_flight **pp = &flights[f->hash % EV_FLIGHT_BUCKETS];
+    while (*pp != f) {
+        pp = &(*pp)->next;
+    }
+    *pp = f->next;
+
+    while (f->waiters != NULL) {
+        ev_req *r = f->waiters;
+        f->waiters = r->next_waiter;
+        r->waiting_on = NULL;
+        if (r->conn->closed) {
+            continue; /* being torn down with its connection */
+        }
+        cache_block *b = lookup_fresh(r, r->key);
+        if (b != NULL) {
+            serve_hit(r, b);
+            conn_pump(r->conn);
+        } else {
+            start_fetch(r);
+        }
+    }
+    free(f->key);
+    free(f);
+}
+
+/* r is not cached: fetch it, or with -s wait for the fetch of the same key
+that is already under way */
+static void fetch_missed(ev_req *r)
+{
+    if (config.coalesce && r->key != NULL) {
+        ev_flight *f = flight_find(r->key);
+        if (f != NULL) {
+            r->state = EV_WAIT_FILL;
+            r->waiting_on = f;
+            r->next_waiter = f->waiters;
+            f->waiters = r;
+            return;
+        }
+        r->flight = flight_start(r->key);
+    }
+    start_fetch(r);
+}
+
+/* disk lookups have finished: what was found is linked back into memory and
+served, the rest is fetched */
+static void on_disk_read(void)
+{
+    disk_query *q = disk_done();
+    while (q != NULL) {
+        disk_query *next = q->next;
+        ev_req *r = q->arg;
+        if (r != NULL) {
+            cache_block *b = NULL;
+            r->disk = NULL;
+            if (q->data != NULL) {
+                b = usable(r, cache_adopt(r->key, q->data, q->size));
+                q->data = NULL;
+            }
+            if (b != NULL) {
+                serve_hit(r, b);
+                conn_pump(r->conn);
+            } else {
+                fetch_missed(r);
+            }
+        }
+        disk_query_free(q);
+        q = next;
+    }
+}
+
+/* copy the request the pieces in iov make up for req, parsed from the n
+bytes at c->in, to buf: the pieces that point into c->in move with it */
+static size_t keep_request(ev_req *r, const ev_conn *c, size_t n)
+{
+    size_t len = 0;
+    memcpy(r->buf, c->in, n);
+    r->stats.copied += n;
+    for (int i = 0; i < r->reqcnt; i++) {
+        char *base = r->req[i].iov_base;
+        if (base >= c->in && base < c->in + n) {
+            r->req[i].iov_base = r->buf + (base - c->in);
+        }
+        len += r->req[i].iov_len;
+    }
+    return len;
+}
+
+/* a new request at the back of c's queue, or NULL if out of memory */
+static ev_req *req_new(ev_conn *c)
+{
+    ev_req *r = arena_alloc(&c->arena, sizeof(ev_req));
+    if (r == NULL) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->conn = c;
+    r->origin.conn = c;
+    r->origin.req = r;
+    r->origin.fd = -1;
+    r->pipefd[0] = r->pipefd[1] = -1;
+    r->copy = !config.splice;
+    relay_stats_init(&r->stats);
+    r->stats.arena = &c->arena;
+    if (c->tail != NULL) {
+        c->tail->next_req = r;
+    } else {
+        c->head = r;
+    }
+    c->tail = r;
+    c->nreqs++;
+    return r;
+}
+
+/* queue a request for the stats report, written once the requests ahead
+of it are answered, and counting them; the connection closes after it */
+static void queue_report(ev_conn *c)
+{
+    ev_req *r = req_new(c);
+    if (r == NULL) {
+        conn_close(c);
+        return;
+    }
+    r->report = true;
+    r->state = EV_SERVE_HIT;
+    r->complete = true;
+    r->head_done = true;
+}
+
+/* render the report for r, now the oldest request; false if that closed
+the connection */
+static bool render_report(ev_req *r)
+{
+    r->out = arena_alloc(&r->conn->arena, STATS_RESPONSE_MAX);
+    if (r->out == NULL) {
+        conn_close(r->conn);
+        return false;
+    }
+    r->len = stats_response(r->out, STATS_RESPONSE_MAX);
+    r->off = 0;
+    return true;
+}
+
+/* queue the parsed request req, the first n bytes at c->in. Returns false
+if it cannot be served, after which the connection takes no more requests */
+static bool handle_request(ev_conn *c, const http_request *req, size_t n)
+{
+    request_target t;
+
+    if (!req_slice_eq(req->method, "GET")) {
+        if (c->head == NULL) {
+            clienterror(c->client.fd, "501", "Not Implemented",
+                        "Proxy does not implement this method");
+        }
+        return false;
+    }
+    /* a path without a host is asked of the proxy itself: only the stats,
+    queued behind the requests before it and written like a hit */
+    if (req->host.len == 0) {
+        if (req_slice_eq(req->path, STATS_PATH)) {
+            queue_report(c);
+        } else if (c->head == NULL) {
+            clienterror(c->client.fd, "400", "Bad Request",
+                        "Proxy could not parse the request");
+        }
+        return false;
+    }
+
+    ev_req *r;
+    if (!request_target_make(req, &c->arena, &t)
+        || (r = req_new(c)) == NULL) {
+        conn_close(c);
+        return false;
+    }
+    r->keepalive = config.client_idle > 0 && client_keepalive(req);
+    if (!r->keepalive) {
+        c->keepalive = false;
+    }
+    r->conditional = client_conditional(req);
+
+    cache_block *b;
+    if (t.key != NULL && (b = lookup_fresh(r, t.key)) != NULL) {
+        serve_hit(r, b);
+        return true;
+    }
+    r->key = t.key;
+    r->host = t.host;
+    r->port = t.port;
+    r->buf = arena_alloc(&c->arena, MAXLINE);
+    r->req = arena_alloc(&c->arena, (request_iov_max(req) + VALIDATOR_IOV_MAX)
+                                        * sizeof(*r->req));
+    if (r->buf == NULL || r->req == NULL) {
+        conn_close(c);
+        return false;
+    }
+    r->reqcnt = request_iov(req, r->port, r->req);
+    r->len = keep_request(r, c, n);
+    /* the head of a response to a closing client goes out as it came */
+    r->head_done = !r->keepalive;
+
+    /* with -D it may be on disk: the disk tier's thread reads it meanwhile.
+    A stale block in memory is newer than what the disk has */
+    if (r->key != NULL && r->stale == NULL
+        && (r->disk = disk_submit(r->key, cache_hash(r->key), r)) != NULL) {
+        r->state = EV_DISK;
+        return true;
+    }
+    fetch_missed(r);
+    return true;
+}
+
+/* whether c may take another request, within EV_PIPELINE_MAX and
+EV_ARENA_MAX. The arena is reset first if nothing points into it: no
+request is left, and no half-parsed head unless it is full anyway (that head
+is parsed again) */
+static bool conn_has_room(ev_conn *c)
+{
+    if (c->nreqs == 0 && c->unreaped == 0 && c->arena.used > 0
+        && (c->parser.done == 0 || c->arena.used >= EV_ARENA_MAX)) {
+        arena_reset(&c->arena);
+        request_parser_reset(&c->parser);
+    }
+    return c->keepalive && c->nreqs < EV_PIPELINE_MAX
+           && c->arena.used < EV_ARENA_MAX;
+}
+
+/* queue every complete request that has come in, as long as there is room */
+static void parse_requests(ev_conn *c)
+{
+    long n = 0;
+    bool room;
+    while ((room = conn_has_room(c))
+           && (n = request_parser_feed(&c->parser, c->in, c->inlen)) > 0) {
+        idle_remove(c);
+        bool ok = handle_request(c, &c->parser.req, n);
+        if (c->closed) {
+            return;
+        }
+        memmove(c->in, c->in + n, c->inlen - n + 1);
+        c->inlen -= n;
+        request_parser_reset(&c->parser);
+        if (!ok) {
+            /* the requests before it are still answered, then we close */
+            c->keepalive = false;
+        }
+    }
+    /* what is left may hold requests: they wait until there is room */
+    c->held = c->keepalive && !room && c->inlen > 0;
+    if (c->keepalive && n < 0) {
+        if (c->head == NULL) {
+            clienterror(c->client.fd, "400", "Bad Request",
+                        "Proxy could not parse the request");
+        }
+        c->keepalive = false;
+    }
+    if (c->keepalive && c->inlen == MAXLINE - 1) {
+        if (c->head == NULL) {
+            clienterror(c->client.fd, "400", "Bad Request",
+                        "Request header too large");
+        }
+        c->keepalive = false;
+    }
+    conn_pump(c);
+}
+
+static void on_client_readable(ev_conn *c)
+{
+    ssize_t n = read(c->client.fd, c->in + c->inlen, MAXLINE - 1 - c->inlen);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn_close(c);
+        }
+        return;
+    }
+    if (n == 0) {
+        /* answer what was asked, then close */
+        c->eof = true;
+        c->keepalive = false;
+        conn_pump(c);
+        return;
+    }
+    c->inlen += n;
+    c->in[c->inlen] = '\0';
+    parse_requests(c);
+}
+
+/* one of the connect attempts finished: the winner becomes the origin */
+static void on_origin_connected(ev_req *r, ev_side *side)
+{
+    ev_watch(side, 0);
+    int fd = conn_race_ready(&r->race, side - r->attempt);
+    if (fd < 0) {
+        race_poll(r);
+        return;
+    }
+    race_end(r);
+    r->stats.connect_ns += now_ns() - r->connect_start;
+    for (int i = 0; i < r->race.addrs.count; i++) {
+        r->attempt[i].fd = -1; /* the others are closed */
+        r->attempt[i].added = false;
+    }
+    r->origin.fd = fd;
+    r->state = EV_SEND_REQUEST;
+    ev_watch(&r->origin, EPOLLOUT);
+}
+
+static void req_watch(ev_req *r);
+
+static void on_origin_writable(ev_req *r)
+{
+    /* the pieces of the request not yet sent, the first one cut short */
+    struct iovec iov[REQUEST_IOV_MAX + VALIDATOR_IOV_MAX];
+    size_t skip = r->off;
+    int i = 0, cnt = 0;
+    while (skip >= r->req[i].iov_len) {
+        skip -= r->req[i++].iov_len;
+    }
+    for (; i < r->reqcnt; i++, skip = 0) {
+        iov[cnt].iov_base = (char *)r->req[i].iov_base + skip;
+        iov[cnt++].iov_len = r->req[i].iov_len - skip;
+    }
+    ssize_t n = writev(r->origin.fd, iov, cnt);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        if (r->reused) {
+            refetch(r);
+        } else {
+            conn_close(r->conn);
+        }
+        return;
+    }
+    r->off += n;
+    if (r->off == r->len) {
+        r->len = r->off = 0;
+        r->state = EV_RELAY;
+        upstream_framing_init(&r->framing);
+        req_watch(r);
+    }
+}
+
+/* where the next read from the origin may go without overwriting bytes not
+yet written: anywhere once they are all out, otherwise right behind them
+while their buffer has room. NULL if they have to be written first */
+static char *read_space(ev_req *r, size_t *space)
+{
+    if (r->len == 0 && r->headcnt == 0) {
+        return cache_pending_space(&r->pending, r->buf, MAXLINE, space);
+    }
+    if (r->out == NULL) {
+        return NULL; /* in the pipe */
+    }
+    char *end = r->out + r->len;
+    if (r->pending.data != NULL && end == r->pending.data + r->pending.size) {
+        *space = MAX_OBJECT_SIZE - r->pending.size;
+    } else if (end > r->buf && end <= r->buf + MAXLINE) {
+        *space = r->buf + MAXLINE - end;
+    } else {
+        return NULL;
+    }
+    return *space > 0 ? end : NULL;
+}
+
+/* true once what r has at out is response for the client: until then buf
+holds the request for the origin */
+static bool req_answering(const ev_req *r)
+{
+    return r->head_done && (r->state == EV_RELAY || r->state == EV_SERVE_HIT);
+}
+
+/* whether r's response is framed: the client or, with -k, the origin
+connection is kept after it, or it may be a 304 for r->stale */
+static bool req_framed(const ev_req *r)
+{
+    return r->keepalive || config.keepalive > 0 || r->stale != NULL;
+}
+
+/* true if the next bytes may go through the pipe: the response is ours to
+write now, will not be cached and, when framed, they are plain body */
+static bool can_splice(ev_req *r, size_t *max)
+{
+    if (r->copy || r->pending.data != NULL || r->conn->head != r
+        || !req_answering(r) || r->headcnt > 0 || r->len > 0) {
+        return false;
+    }
+    *max = req_framed(r) ? upstream_body_left(&r->framing) : SIZE_MAX;
+    return *max > 0;
+}
+
+/* watch the origin only while what it sends has somewhere to go */
+static void req_watch(ev_req *r)
+{
+    size_t space;
+    if (r->state != EV_RELAY || r->origin.fd < 0) {
+        return;
+    }
+    bool room = can_splice(r, &space) || read_space(r, &space) != NULL;
+    ev_watch(&r->origin, room ? EPOLLIN : 0);
+}
+
+/* the response is no longer being cached: move up to max bytes of it into
+the request's pipe. Returns what read() would, or -1 with errno EINVAL
+once splice() turns out not to work here */
+static ssize_t splice_from_origin(ev_req *r, size_t max)
+{
+    if (r->pipefd[0] < 0 && pipe(r->pipefd) < 0) {
+        r->pipefd[0] = r->pipefd[1] = -1;
+        errno = EINVAL;
+        return -1;
+    }
+    return splice(r->origin.fd, NULL, r->pipefd[1], NULL,
+                  max < EV_PIPE_SIZE ? max : EV_PIPE_SIZE,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/* the origin answered r's conditional GET with 304 Not Modified: the stale
+block is fresh again and answers the client like a hit, the 304 itself goes
+no further */
+static void not_modified(ev_req *r)
+{
+    cache_block *b = r->stale;
+    upstream_framing *f = &r->framing;
+    r->stale = NULL;
+    /* the 304 may give a new max-age; its head is in pending, read it
+    before that goes */
+    cache_refresh(b, r->out, f->head_len);
+    cache_pending_abort(&r->pending);
+    if (!upstream_frame_done(f)) {
+        side_close(&r->origin);
+    }
+    r->stats.saved = b->size;
+    serve_hit(r, b);
+}
+
+/* the response head is in, or will not fit: a 304 for r->stale serves that
+instead; otherwise replace its hop-by-hop headers if the client stays, or
+send it as is */
+static void head_ready(ev_req *r)
+{
+    upstream_framing *f = &r->framing;
+    if (r->stale != NULL && f->state != UPSTREAM_HEAD && f->status == 304
+        && f->head_len <= r->len) {
+        not_modified(r);
+        return;
+    }
+    r->head_done = true;
+    if (!r->keepalive) {
+        return; /* held only for its status */
+    }
+    if (f->state != UPSTREAM_HEAD && f->state != UPSTREAM_UNTIL_CLOSE
+        && f->head_len <= r->len
+        && (r->headcnt = response_head_iov(r->out, f->head_len, r->head,
+                                           RESPONSE_IOV_MAX)) > 0) {
+        r->out += f->head_len;
+        r->len -= f->head_len;
+        return;
+    }
+    /* no length to go by: only the connection closing ends the body */
+    r->headcnt = 0;
+    r->keepalive = false;
+    r->conn->keepalive = false;
+}
+
+static void on_origin_readable(ev_req *r)
+{
+    size_t space, max;
+    char *chunk = NULL;
+    ssize_t n;
+    bool framed = req_framed(r);
+
+    if (can_splice(r, &max)) {
+        n = splice_from_origin(r, max);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            /* fall back to copying; epoll reports the origin again */
+            r->copy = true;
+            return;
+        }
+    } else if ((chunk = read_space(r, &space)) != NULL) {
+        n = read(r->origin.fd, chunk, space);
+    } else {
+        ev_watch(&r->origin, 0);
+        return;
+    }
+    r->stats.syscalls++;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0 && r->reused && r->received == 0) {
+        refetch(r);
+        return;
+    }
+    if (n < 0) {
+        conn_close(r->conn);
+        return;
+    }
+    if (n == 0) {
+        /* the origin closed: the response is complete unless it was framed
+        and ended early */
+        if (framed && !upstream_frame_eof(&r->framing)) {
+            conn_close(r->conn);
+            return;
+        }
+        if (!r->head_done) {
+            head_ready(r);
+        }
+        side_close(&r->origin);
+        r->complete = true;
+        conn_pump(r->conn);
+        return;
+    }
+    r->received += n;
+    if (framed) {
+        size_t used = upstream_frame(&r->framing, chunk, n);
+        if (used < (size_t)n) {
+            /* bytes after the end of the response: do not trust the socket */
+            r->framing.keepalive = false;
+            n = used;
+        }
+    }
+    if (chunk >= r->buf && chunk < r->buf + MAXLINE) {
+        r->stats.copied += n; /* not kept: read only to be written again */
+    }
+    if (chunk != NULL && !cache_pending_append(&r->pending, chunk, n)
+        && r->flight != NULL) {
+        /* too big to cache: let the waiters fetch it themselves */
+        flight_end(r->flight);
+        r->flight = NULL;
+    }
+    if (r->len == 0 && r->headcnt == 0) {
+        r->out = chunk;
+        r->off = 0;
+    }
+    r->len += n;
+    if (!r->head_done
+        && (r->framing.state != UPSTREAM_HEAD || !read_space(r, &space))) {
+        head_ready(r);
+    }
+    if (framed && upstream_frame_done(&r->framing)) {
+        release_origin(r);
+    }
+    req_watch(r);
+    conn_pump(r->conn);
+}
+
+/* write out what r has ready; false if that closed the connection */
+static bool flush_to_client(ev_req *r)
+{
+    ev_conn *c = r->conn;
+    while (r->headcnt > 0 || r->off < r->len) {
+        ssize_t n;
+        if (r->headcnt > 0) {
+            /* the rewritten head and the body behind it in one writev() */
+            struct iovec iov[RESPONSE_IOV_MAX + 1];
+            int cnt = r->headcnt;
+            memcpy(iov, r->head, cnt * sizeof(struct iovec));
+            if (r->off < r->len) {
+                iov[cnt].iov_base = r->out + r->off;
+                iov[cnt++].iov_len = r->len - r->off;
+            }
+            n = writev(c->client.fd, iov, cnt);
+        } else if (r->out == NULL) {
+            n = splice(r->pipefd[0], NULL, c->client.fd, NULL, r->len - r->off,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            n = write(c->client.fd, r->out + r->off, r->len - r->off);
+        }
+        r->stats.syscalls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            conn_close(c);
+            return false;
+        }
+        relay_stats_sent(&r->stats, n);
+        while (r->headcnt > 0 && (size_t)n >= r->head[0].iov_len) {
+            n -= r->head[0].iov_len;
+            r->headcnt--;
+            memmove(r->head, r->head + 1, r->headcnt * sizeof(struct iovec));
+        }
+        if (r->headcnt > 0) {
+            r->head[0].iov_base = (char *)r->head[0].iov_base + n;
+            r->head[0].iov_len -= n;
+        } else {
+            r->off += n;
+        }
+    }
+    r->len = r->off = 0;
+    return true;
+}
+
+/* the oldest request has been answered completely */
+static void finish_request(ev_req *r)
+{
+    ev_conn *c = r->conn;
+    if (r->hit != NULL) {
+        log_request(r->hit->key, true, &r->stats);
+    } else if (!r->report) {
+        log_request(r->key, false, &r->stats);
+        if (r->key != NULL) {
+            cache_pending_commit(&r->pending, r->key);
+        }
+    }
+    c->head = r->next_req;
+    if (c->head == NULL) {
+        c->tail = NULL;
+    }
+    c->nreqs--;
+    req_free(r);
+}
+
+/* write what the oldest requests have ready, retire the ones answered, and
+decide what the client is watched for next */
+static void conn_pump(ev_conn *c)
+{
+    ev_req *r;
+    while (!c->closed && (r = c->head) != NULL) {
+        if (r->report && r->out == NULL && !render_report(r)) {
+            return;
+        }
+        if (req_answering(r) && !flush_to_client(r)) {
+            return;
+        }
+        if (!r->complete || r->headcnt > 0 || r->len > 0) {
+            req_watch(r);
+            break;
+        }
+        finish_request(r);
+    }
+    if (c->closed) {
+        return;
+    }
+    if (c->head == NULL && (!c->keepalive || c->eof)) {
+        conn_close(c);
+        return;
+    }
+
+    r = c->head;
+    bool want_write = r != NULL && req_answering(r)
+                      && (r->headcnt > 0 || r->len > 0);
+    bool want_read = conn_has_room(c);
+    ev_watch(&c->client, (want_read ? EPOLLIN : 0)
+                             | (want_write ? EPOLLOUT : 0));
+    if (want_read && c->held) {
+        parse_requests(c); /* requests held back for room */
+    } else if (c->head == NULL && !c->idle && config.client_idle > 0) {
+        idle_add(c);
+    }
+}
+
+static void dispatch(ev_side *side, uint32_t events)
+{
+    ev_conn *c = side->conn;
+    ev_req *r = side->req;
+    if (c->closed) {
+        return;
+    }
+
+    if (r == NULL) {
+        if (events & EPOLLIN) {
+            on_client_readable(c);
+        } else if (events & EPOLLOUT) {
+            conn_pump(c);
+        } else if (events & (EPOLLERR | EPOLLHUP)) {
+            conn_close(c);
+        }
+        return;
+    }
+    if (r->closed) {
+        return;
+    }
+
+    switch (r->state) {
+    case EV_CONNECT:
+        on_origin_connected(r, side);
+        if (r->closed || r->state != EV_SEND_REQUEST) {
+            break;
+        }
+        /* connected: the socket is writable, send right away */
+        on_origin_writable(r);
+        break;
+    case EV_SEND_REQUEST:
+        on_origin_writable(r);
+        break;
+    case EV_RELAY:
+        on_origin_readable(r);
+        break;
+    default:
+        break;
+    }
+}
+
+void evloop_run(int listenfd)
+{
+    struct epoll_event events[EV_MAXEVENTS];
+    ev_side listen_side = {NULL, NULL, listenfd, false, 0};
+    ev_side resolver_side = {NULL, NULL, -1, false, 0};
+    ev_side disk_side = {NULL, NULL, -1, false, 0};
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    set_nonblocking(listenfd);
+    ev_watch(&listen_side, EPOLLIN);
+    resolver_side.fd = resolver_fd();
+    ev_watch(&resolver_side, EPOLLIN);
+    if ((disk_side.fd = disk_fd()) >= 0) {
+        ev_watch(&disk_side, EPOLLIN);
+    }
+
+    while (1) {
+        /* wake up for the next connect attempt or timeout, and now and then
+        while idle clients are around to expire them */
+        int timeout = idle_head != NULL ? 1000 : -1;
+        for (ev_req *r = racing; r != NULL; r = r->race_next) {
+            int wait = conn_race_wait(&r->race);
+            if (timeout < 0 || wait < timeout) {
+                timeout = wait;
+            }
+        }
+        int n = epoll_wait(epfd, events, EV_MAXEVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            ev_side *side = events[i].data.ptr;
+            if (side == &listen_side) {
+                accept_clients(listenfd);
+            } else if (side == &resolver_side) {
+                on_resolved();
+            } else if (side == &disk_side) {
+                on_disk_read();
+            } else {
+                dispatch(side, events[i].events);
+            }
+        }
+        for (ev_req *r = racing, *next; r != NULL; r = next) {
+            next = r->race_next;
+            if (!r->closed) {
+                race_poll(r);
+            }
+        }
+        expire_idle();
+        reap_dead();
+    }
+}
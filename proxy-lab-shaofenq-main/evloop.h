@@ -0,0 +1,18 @@
+/**
+ * @file evloop.h
+ * @brief epoll based event loop for the proxy
+ *
+ * In event mode a single thread multiplexes every client and origin socket.
+ * Each connection is a small state machine (read request, connect to the
+ * origin, send the rewritten request, relay the response) that only runs
+ * when epoll reports its socket ready, so an idle connection costs one
+ * struct and no thread stack.
+ */
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/* Serve connections accepted on listenfd forever */
+void evloop_run(int listenfd);
+
+#endif /* EVLOOP_H */
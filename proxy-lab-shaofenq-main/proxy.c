@@ -2,13 +2,35 @@
  * Shaofeng Qin, shaofenq
  shaofenq@cmu.edu
 
-In this lab, we have three parts, and the checkpoint only requires the first part that implement a sequential server(proxy). 
+In this lab, we have three parts, and the checkpoint only requires the first part that implement a sequential server(proxy).
 the basic implementation skeleton is based on the tiny server and textbook
+
+The proxy can run in two connection models, picked on the command line:
+  - thread mode (default): a fixed pool of worker threads takes connfds
+    from a bounded queue (sbuf.c) and blocks in doit(); -w 0 goes back to
+    one detached thread per accepted connection
+  - event mode (-e): a single epoll loop (evloop.c) that drives every
+    client and origin socket as a non-blocking state machine
  */
 
 /* Some useful includes to help you get started */
 
+#define _GNU_SOURCE /* SO_REUSEPORT, splice() */
+
+#include "arena.h"
+#include "cache.h"
+#include "conn.h"
 #include "csapp.h"
+#include "disk.h"
+#include "evloop.h"
+#include "proxy.h"
+#include "refresh.h"
+#include "request.h"
+#include "resolver.h"
+#include "sbuf.h"
+#include "scan.h"
+#include "stats.h"
+#include "upstream.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -18,14 +40,17 @@ the basic implementation skeleton is based on the tiny server and textbook
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 /*
@@ -40,243 +65,1438 @@ the basic implementation skeleton is based on the tiny server and textbook
 #define dbg_printf(...)
 #endif
 
-/*
- * Max cache and object sizes
- * You might want to move these to the file containing your cache implementation
- */
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
-
 /*
  * String to use for the User-Agent header.
  * Don't forget to terminate with \r\n
  */
-static const char *header_user_agent = "Mozilla/5.0"
+static const char *header_user_agent = "User-Agent: Mozilla/5.0"
                                        " (X11; Linux x86_64; rv:3.10.0)"
                                        " Gecko/20191101 Firefox/63.0.1\r\n";
 //Always send the following Connection header:
 static const char *header_connection = "Connection: close\r\n";
 //Always send the following Proxy-Connection header:
 static const char *header_proxy = "Proxy-Connection: close\r\n";
+// except with -k, where origin connections are kept for the next request
+// (the same line tells a persistent client its connection stays open)
+static const char *header_connection_keepalive = "Connection: keep-alive\r\n";
+static const char *header_proxy_keepalive = "Proxy-Connection: keep-alive\r\n";
 
 // functions used
-void doit(int fd);
-void parse_uri(char *uri, char *hostname, int* port, char *path);
+void doit(int fd, arena *a);
+static bool serve_request(int fd, rio_t *rio_client, request_parser *parser,
+                          arena *a);
+static ssize_t read_head(rio_t *rio_client, request_parser *parser, char *head,
+                         size_t size);
+
+//concurently handle multi connection request using multi threads
+void *thread(void *vargp);
+void *worker(void *vargp);
+void *acceptor(void *vargp);
+static void snapshot_signals(sigset_t *set);
+static void *snapshot_thread(void *vargp);
+
+static void usage(const char *prog);
+static ssize_t relay_writen(int fd, const char *buf, size_t n, relay_stats *st);
+static ssize_t relay_writev(int fd, struct iovec *iov, int cnt, relay_stats *st);
+static bool send_head(int fd, const char *data, size_t n, const upstream_framing *f,
+                      relay_stats *st);
+static bool send_stored(int fd, const char *data, size_t size, bool keepalive,
+                        relay_stats *st);
+static ssize_t relay_splice(int from, int to, size_t max, relay_stats *st);
+static int connect_origin(const char *host, const char *port, relay_stats *st);
+static bool send_request(int fd, const http_request *req, const char *port,
+                         const cache_block *stale, arena *a);
+static int open_listenfd_reuseport(const char *port);
+static unsigned long now_ns(void);
 
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-void generate_header(char *header, char* hostname, int* port, char* path, rio_t* rio_client);
+typedef struct sockaddr SA;
 
+/* thread model settings, see usage() */
+#define DEFAULT_WORKERS 32
+#define DEFAULT_QUEUE_SLOTS 256
 
+static int nworkers = DEFAULT_WORKERS;  // 0 means one thread per connection
+static bool reject_when_full = false;   // queue full: 503 instead of blocking accept
+static bool verbose = false;            // -v: one log line per request
+static unsigned long started;           // when main() began, for -v timings
+proxy_config config;
+static sbuf_t connq;                    // connfds waiting for a worker
 
-int main(int argc, char **argv) 
+int main(int argc, char **argv)
 {
-    //printf("%s", header_user_agent);
-    int listenfd, connfd, port, clientlen;
-    char hostname[MAXLINE], port[MAXLINE];
-    struct sockaddr_in clientaddr;
+    int listenfd;
+    pthread_t tid;
+    bool event_mode = false;
+    int queue_slots = DEFAULT_QUEUE_SLOTS;
+    int nacceptors = 1;
+    int opt;
+
     /* Check command line args */
-    if (argc != 2) 
+    config.splice = true;
+    config.client_idle = CLIENT_IDLE_SECS;
+    int idle_secs = UPSTREAM_IDLE_SECS;
+    int dns_ttl = RESOLVER_TTL_SECS;
+    const char *hosts_file = NULL;
+    int connect_timeout = CONN_TIMEOUT_SECS;
+    bool tinylfu = false;
+    int refreshers = 0;
+    int dump_secs = 0;
+    const char *eviction = "lru";
+    const char *disk_dir = NULL;
+    const char *snapshot = NULL;
+    started = now_ns();
+    while ((opt = getopt(argc, argv, "ew:q:b:a:snk:i:c:d:H:t:fp:D:S:r:m:vh")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        switch (opt)
+        {
+        case 'e':
+            event_mode = true;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            queue_slots = atoi(optarg);
+            break;
+        case 'b':
+            if (!strcmp(optarg, "reject"))
+            {
+                reject_when_full = true;
+            }
+            else if (strcmp(optarg, "block"))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            nacceptors = atoi(optarg);
+            break;
+        case 'n':
+            config.splice = false;
+            break;
+        case 'k':
+            config.keepalive = atoi(optarg);
+            break;
+        case 'i':
+            idle_secs = atoi(optarg);
+            break;
+        case 'c':
+            config.client_idle = atoi(optarg);
+            break;
+        case 'd':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 't':
+            connect_timeout = atoi(optarg);
+            break;
+        case 's':
+            config.coalesce = true;
+            break;
+        case 'f':
+            tinylfu = true;
+            break;
+        case 'p':
+            eviction = optarg;
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'S':
+            snapshot = optarg;
+            break;
+        case 'r':
+            refreshers = atoi(optarg);
+            break;
+        case 'm':
+            dump_secs = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nworkers < 0 || queue_slots < 1 || nacceptors < 1
+        || config.keepalive < 0 || idle_secs < 1 || config.client_idle < 0
+        || dns_ttl < 0 || connect_timeout < 1 || refreshers < 0
+        || dump_secs < 0)
+    {
+        usage(argv[0]);
+    }
+    // the snapshot thread takes these with sigwait(), so every other thread
+    // must block them; threads inherit the mask of the one creating them
+    if (snapshot != NULL)
+    {
+        sigset_t signals;
+        snapshot_signals(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
+    // several acceptors each get their own SO_REUSEPORT socket so the kernel
+    // spreads incoming connections over them
+    if (nacceptors > 1 && !event_mode)
+    {
+        listenfd = open_listenfd_reuseport(argv[optind]);
+    }
+    else
+    {
+        listenfd = open_listenfd(argv[optind]);
+    }
+    if (listenfd < 0)
+    {
+        fprintf(stderr, "failed to listen on port %s\n", argv[optind]);
         exit(1);
     }
-    listenfd = open_listenfd(argv[1]);
+    signal(SIGPIPE, SIG_IGN);
+    if (!cache_init(eviction, tinylfu))
+    {
+        usage(argv[0]);
+    }
+    // the disk tier's index is mapped, not read, so a warm restart serves
+    // hits from it as soon as this returns
+    if (disk_dir != NULL)
+    {
+        unsigned long start = now_ns();
+        int found = disk_init(disk_dir);
+        if (found < 0)
+        {
+            fprintf(stderr, "failed to open disk cache in %s: %s\n", disk_dir, strerror(errno));
+            exit(1);
+        }
+        if (verbose)
+        {
+            fprintf(stderr, "disk cache %s: %d objects, ready in %.2f ms\n", disk_dir, found,
+                    (now_ns() - start) / 1e6);
+        }
+    }
+    // restoring runs beside the listener, which accepts from here on
+    if (snapshot != NULL)
+    {
+        pthread_create(&tid, NULL, snapshot_thread, (void *)snapshot);
+    }
+    upstream_init(config.keepalive, idle_secs);
+    if (resolver_init(dns_ttl, hosts_file) < 0)
+    {
+        fprintf(stderr, "failed to read hosts file %s\n", hosts_file);
+        exit(1);
+    }
+    conn_init(connect_timeout);
+    refresh_init(refreshers);
+    stats_init(dump_secs);
+
+    if (event_mode)
+    {
+        evloop_run(listenfd);
+        return 0;
+    }
+
+    //pre-spawn the workers so no thread is created on the accept path
+    if (nworkers > 0)
+    {
+        sbuf_init(&connq, queue_slots);
+        for (int i = 0; i < nworkers; i++)
+        {
+            pthread_create(&tid, NULL, worker, NULL);
+        }
+    }
+    for (int i = 1; i < nacceptors; i++)
+    {
+        int *fdp = malloc(sizeof(int));
+        if ((*fdp = open_listenfd_reuseport(argv[optind])) < 0)
+        {
+            fprintf(stderr, "failed to open extra listener on port %s\n", argv[optind]);
+            exit(1);
+        }
+        pthread_create(&tid, NULL, acceptor, fdp);
+    }
+    int *fdp = malloc(sizeof(int));
+    *fdp = listenfd;
+    acceptor(fdp);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-e] [-w workers] [-q slots] [-b block|reject] [-a acceptors] [-s] [-n] [-k idle] [-i secs] [-c secs] [-d secs] [-H hosts] [-t secs] [-f] [-p lru|s3fifo|gdsf] [-D dir] [-S file] [-r refreshers] [-m secs] [-v] <port>\n", prog);
+    fprintf(stderr, "  -e  serve with the epoll event loop instead of threads\n");
+    fprintf(stderr, "  -w  worker threads, 0 for one thread per connection (default %d)\n", DEFAULT_WORKERS);
+    fprintf(stderr, "  -q  connections that may wait for a worker (default %d)\n", DEFAULT_QUEUE_SLOTS);
+    fprintf(stderr, "  -b  when the queue is full: block accept (default) or reject with 503\n");
+    fprintf(stderr, "  -a  acceptor threads, each on its own SO_REUSEPORT socket (default 1)\n");
+    fprintf(stderr, "  -s  single-flight: concurrent misses on one URI share one origin fetch\n");
+    fprintf(stderr, "  -n  relay uncacheable responses through user space instead of splice()\n");
+    fprintf(stderr, "  -k  keep up to this many idle connections per origin for reuse (default 0)\n");
+    fprintf(stderr, "  -i  seconds an idle origin connection is kept (default %d)\n", UPSTREAM_IDLE_SECS);
+    fprintf(stderr, "  -c  seconds a client may idle between requests, 0 closes after one (default %d)\n", CLIENT_IDLE_SECS);
+    fprintf(stderr, "  -d  seconds a resolved origin address is cached, 0 for none (default %d)\n", RESOLVER_TTL_SECS);
+    fprintf(stderr, "  -H  resolve the names in this /etc/hosts style file from it\n");
+    fprintf(stderr, "  -t  seconds to connect to an origin, over all its addresses (default %d)\n", CONN_TIMEOUT_SECS);
+    fprintf(stderr, "  -f  cache a new object only if it is asked for more often than what it evicts (TinyLFU)\n");
+    fprintf(stderr, "  -p  eviction policy: lru (default), s3fifo or gdsf (small objects asked for often stay)\n");
+    fprintf(stderr, "  -D  also cache responses on disk in this directory, kept across restarts\n");
+    fprintf(stderr, "  -S  restore the cache from this file at startup, save it there on SIGUSR1 and on exit\n");
+    fprintf(stderr, "  -r  serve stale entries at once, refreshed by this many background threads (default 0)\n");
+    fprintf(stderr, "  -m  write the %s report to stderr every this many seconds\n", STATS_PATH);
+    fprintf(stderr, "  -v  log bytes, copies, syscalls and MB/s for every request\n");
+    exit(1);
+}
+
+static void snapshot_signals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+}
+
+/* with -S: restore the cache from the snapshot, then write a new one on
+every SIGUSR1, and a last one on SIGTERM or SIGINT before exiting */
+static void *snapshot_thread(void *vargp)
+{
+    const char *path = vargp;
+    sigset_t signals;
+    int sig, restored;
+
+    pthread_detach(pthread_self());
+    if ((restored = cache_restore(path)) < 0 && errno != ENOENT)
+    {
+        fprintf(stderr, "not restoring %s: %s\n", path, strerror(errno));
+    }
+    else if (restored >= 0 && verbose)
+    {
+        fprintf(stderr, "snapshot %s: %d objects restored %.2f ms after start\n",
+                path, restored, (now_ns() - started) / 1e6);
+    }
+
+    snapshot_signals(&signals);
+    while (1)
+    {
+        sigwait(&signals, &sig);
+        if (!cache_snapshot(path))
+        {
+            fprintf(stderr, "failed to write snapshot %s\n", path);
+        }
+        else if (verbose)
+        {
+            fprintf(stderr, "snapshot %s written\n", path);
+        }
+        if (sig != SIGUSR1)
+        {
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+/* accept connections on one listening socket and hand them to the workers */
+void *acceptor(void *vargp)
+{
+    int listenfd = *((int *)vargp);
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    char hostname[MAXLINE], port[MAXLINE];
+    pthread_t tid;
+    int connfd;
+
+    free(vargp);
+    pthread_detach(pthread_self());
     while (1) {
         clientlen = sizeof(clientaddr);
         connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Connection is established from host: %s, port: %s\n", hostname, port);
-        doit(connfd);
+        if (connfd < 0)
+        {
+            continue;
+        }
+        // numeric only: a reverse DNS lookup here would stall every accept
+        getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+        dbg_printf("Connection is established from host: %s, port: %s\n", hostname, port);
+
+        if (nworkers == 0)
+        {
+            //create threads for handling connection request(call doit)
+            int *connfdp = malloc(sizeof(int));
+            *connfdp = connfd;
+            pthread_create(&tid, NULL, thread, connfdp);
+        }
+        else if (!reject_when_full)
+        {
+            sbuf_insert(&connq, connfd);
+        }
+        else if (!sbuf_tryinsert(&connq, connfd))
+        {
+            // every worker is busy and the queue is full: shed the load
+            clienterror(connfd, "503", "Service Unavailable", "Proxy is overloaded, try again later");
+            close(connfd);
+        }
+    }
+    return NULL;
+}
+
+// a pre-spawned worker serves connections from the queue forever, one at
+// a time, so its arena serves as the arena of each of them in turn
+void *worker(void *vargp)
+{
+    arena a;
+
+    arena_init(&a);
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        int connfd = sbuf_remove(&connq);
+        doit(connfd, &a);
         close(connfd);
     }
-    return 0;
+    return NULL;
+}
+
+// wirte detached threads fo handle
+void *thread(void *vargp)
+{
+    int connfd = *((int *)vargp);
+    arena a;
+
+    arena_init(&a);
+    pthread_detach(pthread_self());
+    free(vargp);
+    doit(connfd, &a);
+    close(connfd);
+    arena_free(&a);
+    return NULL;
+}
+
+/* same as open_listenfd in csapp.c, but lets several sockets bind the same
+port so each acceptor thread owns one */
+static int open_listenfd_reuseport(const char *port)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+    {
+        return -2;
+    }
+    for (p = listp; p; p = p->ai_next)
+    {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p)
+    {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0)
+    {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
 }
 
+
 //skeleton based on textbook, but made some modification since it does the job of a proxy(
 // send/receive mesaages on both ends: client and server
 /* this has some difference with server since we only need to transfer messages
 instead of dealing with staic or dynamic requests.
 */
-void doit(int fd)
-{ 
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE], hostname[MAXLINE], path[MAXLINE];
-    char header[MAXLINE];
-    rio_t rio_client, rio_server;
-    int server_fd, message_size;
-    int *port = NULL;
-    /* step 1: Read request line and headers */
+void doit(int fd, arena *a)
+{
+    rio_t rio_client;
+    request_parser parser; // reused for every request on the connection
+
+    // what a request needs beyond these comes from a, which is reset for
+    // the next one: after the first few requests no malloc() at all
+    request_parser_init(&parser, a);
+    stats_count(STAT_CLIENTS_OPENED, 1);
+    // a persistent client gets client_idle seconds to send its next request;
+    // pipelined requests are already waiting in rio_client's buffer and are
+    // answered in order, one after the other
     rio_readinitb(&rio_client, fd);
-    rio_readlineb(&rio_client, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    if (config.client_idle > 0)
+    {
+        struct timeval idle = {config.client_idle, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    }
+    while (serve_request(fd, &rio_client, &parser, a))
+    {
+    }
+    stats_count(STAT_CLIENTS_CLOSED, 1);
+}
+
+/* answer one request from the client; returns true if the connection can
+carry another one */
+static bool serve_request(int fd, rio_t *rio_client, request_parser *parser,
+                          arena *a)
+{
+    char *buf;
+    const http_request *req = &parser->req;
+    int server_fd;
+    ssize_t message_size;
+    request_target target;
+    relay_stats stats;
+
+    // everything the last request took from the arena is free again; buf
+    // comes first so the header table is allocated behind it
+    arena_reset(a);
+    if ((buf = arena_alloc(a, MAXLINE)) == NULL)
+    {
+        return false;
+    }
+    /* step 1: Read request line and headers, taking them apart as they
+    come in; the request is described by slices of buf, nothing is copied */
+    ssize_t head_len = read_head(rio_client, parser, buf, MAXLINE);
+    if (head_len == 0)
+    {
+        return false;
+    }
+    relay_stats_init(&stats);
+    stats.arena = a;
+    if (head_len < 0)
+    {
+        clienterror(fd, "400", "Bad Request", "Proxy could not parse the request");
+        return false;
+    }
+    // the head was copied out of rio's buffer into buf
+    stats.copied = head_len;
+
     // we are required to only handle the GET request for now, otherwise, print not implememnted
-    if (strcasecmp(method, "GET")) 
+    if (!req_slice_eq(req->method, "GET"))
     {
-        clienterror(fd, method, "501", "Not Implemented","Proxy does not implement this method");
-        return;
+        clienterror(fd, "501", "Not Implemented", "Proxy does not implement this method");
+        return false;
+    }
+    // a path without a host is asked of the proxy itself: only the stats
+    if (req->host.len == 0)
+    {
+        if (req_slice_eq(req->path, STATS_PATH))
+        {
+            stats_send(fd);
+        }
+        else
+        {
+            clienterror(fd, "400", "Bad Request", "Proxy could not parse the request");
+        }
+        return false;
     }
-    
     /* step 2: forward request to server
-    Parse URI from GET request
-    and save in the varibales: port, hostname, path
-    port is by default to be 80 */
-    parse_uri(uri, hostname, port, path);
-
-    // build the request header sent to server
-    generate_header(header, hostname, port, path, &rio_client);
-
-    //make connection to server
-    /* note port is in type int*, we need to type casting to char*
-    */
-   char port_buf[20];
-   sprintf(port_buf, "%d", *port);
-   if ((server_fd = open_clientfd(hostname, port_buf)) <0)
-   {
+    the URI has been split into hostname, port (80 by default) and path */
+    if (!request_target_make(req, a, &target))
+    {
+        return false;
+    }
+    const char *hostname = target.host, *port_str = target.port;
+    const char *key = target.key;
+
+    // the client's headers also tell whether it wants to keep the connection
+    bool keepalive = config.client_idle > 0 && client_keepalive(req);
+
+    // serve straight from the cache when we can
+    bool cacheable = key != NULL;
+    cache_block *block = NULL;
+    cache_block *stale = NULL; // revalidated with a conditional GET
+    cache_fill *fill = NULL;
+    if (cacheable)
+    {
+        // with -s a miss on a key someone is already fetching waits for that
+        // fetch instead of opening another origin connection
+        block = config.coalesce ? cache_lookup_coalesced(key, &fill) : cache_lookup(key);
+    }
+    // with -r a stale copy is served as it is while a refresh worker asks
+    // the origin after it, so nobody waits for the origin when it expires
+    if (block != NULL && !cache_fresh(block) && !refresh_stale(block))
+    {
+        // a stale copy with a validator is asked after: on a 304 it is served
+        // again and the origin does not send the body. Without one, or when
+        // the client asks a conditional question of its own, it is a miss;
+        // either way what the origin sends instead replaces it
+        if ((block->etag != NULL || block->last_modified != NULL)
+            && !client_conditional(req))
+        {
+            stale = block;
+        }
+        else
+        {
+            cache_release(block);
+        }
+        block = NULL;
+    }
+    if (block != NULL)
+    {
+        // the block's buffer goes to the socket as is, no copy on a hit
+        keepalive = send_stored(fd, block->data, block->size, keepalive, &stats);
+        log_request(key, true, &stats);
+        cache_release(block);
+        return keepalive;
+    }
+
+    //make connection to server, reusing an idle one with -k
+    bool pooled = config.keepalive > 0;
+    server_fd = pooled ? upstream_take(hostname, port_str) : -1;
+    bool reused = server_fd >= 0;
+    if (!reused)
+    {
+        server_fd = connect_origin(hostname, port_str, &stats);
+    }
+    bool sent = server_fd >= 0 && send_request(server_fd, req, port_str, stale, a);
+    if (!sent && reused)
+    {
+        // the origin dropped the idle connection and the write noticed: send
+        // the request once more on a fresh one
+        close(server_fd);
+        reused = false;
+        server_fd = connect_origin(hostname, port_str, &stats);
+        sent = server_fd >= 0 && send_request(server_fd, req, port_str, stale, a);
+    }
+    if (!sent)
+    {
         //error message
-        printf("connection to server failed.\n");
-        return;
+        sio_printf("connection to server failed.\n");
+        if (server_fd >= 0)
+        {
+            close(server_fd);
+        }
+        if (fill != NULL)
+        {
+            cache_fill_end(fill);
+        }
+        if (stale != NULL)
+        {
+            cache_release(stale);
+        }
+        return false;
     }
-    //forward the header we generate to the server
-    rio_readinitb(&rio_server, server_fd);
-    rio_writen(server_fd, header, strlen(header));
-    
-    
+
     //step3 & 4read from server's reply and forward to client
-    while ((message_size = rio_readlineb(&rio_server, buf, MAXLINE))>0)
+    // each read goes straight into the pending cache entry while the response
+    // still fits, and is forwarded from there as soon as it arrives. The
+    // response is framed when the origin (-k) or the client connection is to
+    // be reused, or when a revalidation needs its status, so we stop at its end
+    cache_pending pending;
+    cache_pending_init(&pending, cacheable);
+    upstream_framing framing;
+    upstream_framing_init(&framing);
+    bool framed = pooled || keepalive || stale != NULL;
+    // a keep-alive client gets the head with our own Connection header, and
+    // a revalidation must see the status before anything goes out, so the
+    // head is held back until it is complete; it sits at head
+    char *head = NULL;
+    size_t held = 0;
+    bool not_modified = false;
+    size_t space, used;
+    char *chunk;
+    bool use_splice = config.splice;
+    while (1)
+    {
+        if (framed && upstream_frame_done(&framing) && held == 0)
+        {
+            message_size = 0;
+            break;
+        }
+        size_t max = framed ? upstream_body_left(&framing) : SIZE_MAX;
+        if (use_splice && pending.data == NULL && max > 0 && held == 0)
+        {
+            // nothing more will be cached: the kernel moves the rest
+            ssize_t moved = relay_splice(server_fd, fd, max, &stats);
+            if (moved >= 0)
+            {
+                if (framed)
+                {
+                    upstream_frame(&framing, NULL, moved);
+                }
+                if ((size_t)moved < max)
+                {
+                    message_size = 0;
+                    break;
+                }
+                continue;
+            }
+            if (errno != EINVAL && errno != ENOSYS)
+            {
+                message_size = -1;
+                break;
+            }
+            use_splice = false;
+        }
+        if (held > 0 && pending.data == NULL)
+        {
+            // the head so far is in buf: keep it together
+            chunk = buf + held;
+            space = MAXLINE - held;
+        }
+        else
+        {
+            chunk = cache_pending_space(&pending, buf, MAXLINE, &space);
+        }
+        message_size = read(server_fd, chunk, space);
+        stats.syscalls++;
+        if (message_size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (message_size <= 0 && reused && stats.sent == 0 && held == 0)
+        {
+            // the origin dropped the idle connection before we used it:
+            // send the request once more on a fresh one (nothing has been
+            // read into buf yet, so req still points at the request)
+            close(server_fd);
+            reused = false;
+            if ((server_fd = connect_origin(hostname, port_str, &stats)) < 0
+                || !send_request(server_fd, req, port_str, stale, a))
+            {
+                message_size = -1;
+                break;
+            }
+            continue;
+        }
+        if (message_size <= 0)
+        {
+            break;
+        }
+        used = message_size;
+        if (framed && (used = upstream_frame(&framing, chunk, used)) < (size_t)message_size)
+        {
+            // bytes after the end of the response: do not trust this socket
+            framing.keepalive = false;
+        }
+        if (chunk >= buf && chunk < buf + MAXLINE)
+        {
+            // not kept for the cache: read in only to be written out again
+            stats.copied += used;
+        }
+        if (!cache_pending_append(&pending, chunk, used) && fill != NULL)
+        {
+            // too big to cache: let anyone waiting on us fetch it themselves
+            cache_fill_end(fill);
+            fill = NULL;
+        }
+        if ((keepalive || stale != NULL) && stats.sent == 0)
+        {
+            if (held == 0)
+            {
+                head = chunk;
+            }
+            held += used;
+            if (framing.state == UPSTREAM_HEAD && held < MAXLINE)
+            {
+                continue;
+            }
+            if (stale != NULL && framing.status == 304)
+            {
+                // still good: the stored copy answers the client
+                not_modified = true;
+                message_size = 0;
+                break;
+            }
+            // the whole head is in (or is too long to hold): send it on
+            if (keepalive)
+            {
+                keepalive = send_head(fd, head, held, &framing, &stats);
+            }
+            else
+            {
+                relay_writen(fd, head, held, &stats);
+            }
+            held = 0;
+            if (stats.sent == 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (relay_writen(fd, chunk, used, &stats) < 0)
+        {
+            break;
+        }
+    }
+    if (held > 0 && !not_modified)
+    {
+        // the response ended inside its head: pass on what there is
+        relay_writen(fd, head, held, &stats);
+        keepalive = false;
+    }
+    if (message_size == 0 && framed && !upstream_frame_eof(&framing))
     {
-        rio_writen(fd, buf, message_size);
+        // the origin closed before the framed end of the response
+        message_size = -1;
+    }
+    if (not_modified)
+    {
+        // the 304 may give a new max-age; its head is in pending, read it
+        // before that goes
+        cache_refresh(stale, head, held);
+        cache_pending_abort(&pending);
+        keepalive = send_stored(fd, stale->data, stale->size, keepalive, &stats);
+        stats.saved = stale->size;
+        log_request(key, true, &stats);
+    }
+    else
+    {
+        // reads into the pending entry went out from there, uncopied
+        log_request(key, false, &stats);
+        // only a response that arrived completely goes into the cache, which
+        // keeps the pending buffer itself rather than a copy of it
+        if (message_size == 0)
+        {
+            cache_pending_commit(&pending, key);
+        }
+        else
+        {
+            cache_pending_abort(&pending);
+        }
+    }
+    if (stale != NULL)
+    {
+        cache_release(stale);
+    }
+    if (fill != NULL)
+    {
+        cache_fill_end(fill);
     }
-    
-    close(server_fd);
 
+    if (pooled && message_size == 0 && framing.keepalive && upstream_frame_done(&framing))
+    {
+        upstream_put(hostname, port_str, server_fd);
+    }
+    else if (server_fd >= 0)
+    {
+        close(server_fd);
+    }
+    return keepalive && message_size == 0;
 }
 
-/*parse the client' request
-pre: full uri
-post: hostname, server port, path
-by default, the port is 80 if not specified
+/* read the request line and headers into head and feed them to parser a
+line at a time; returns the length of the head, 0 if the client closed (or
+went idle) before sending a request, or -1 if it is too big, cut short or
+malformed */
+static ssize_t read_head(rio_t *rio_client, request_parser *parser, char *head,
+                         size_t size)
+{
+    size_t used = 0;
+    ssize_t n;
+    long rc;
+
+    request_parser_reset(parser);
+    while ((n = scan_readlineb(rio_client, head + used, size - used)) > 0)
+    {
+        used += n;
+        if ((rc = request_parser_feed(parser, head, used)) != 0)
+        {
+            return rc;
+        }
+        if (used == size - 1)
+        {
+            return -1;
+        }
+    }
+    return used == 0 ? 0 : -1;
+}
 
-uri -> http://www.cmu.edu:8080/hub/index.html 
-ptr1 -> www.cmu.edu:8080
-ptr2 -> /hub/index.html
+/* true for the client headers that do not go to the origin: the ones the
+proxy always sends its own version of, and the hop-by-hop ones, which only
+describe the client's connection (and would confuse a pooled origin one) */
+static bool is_replaced_header(req_header_kind kind)
+{
+    return kind == HDR_HOST || kind == HDR_USER_AGENT || request_hop_by_hop(kind);
+}
 
-strstr is the function that finds the first occurance of the specified string
+/*format the header by making:
+first line: GET + path
+second line: Host: hostname  + port
+then any other header the client sent, unchanged, hop-by-hop ones aside
+then User-Agent, Connection and Proxy-Connection and the blank line
+each piece points at the client's request or a constant, and the client's
+headers go in runs: a stretch of kept lines is one iovec
 */
-void parse_uri(char *uri, char *hostname, int* port, char *path)
+int request_iov(const http_request *req, const char *port, struct iovec *iov)
 {
-    char *hostname = "www.cmu.edu";
-    *port = 80;
-    char *start, *port_pos, *path_pos;
-    if (start = strstr(uri, "//") == NULL)
+    int cnt = 0;
+    const char *run = NULL;
+    size_t runlen = 0;
+
+#define IOV_ADD(base, len)                          \
+    do                                              \
+    {                                               \
+        iov[cnt].iov_base = (char *)(base);         \
+        iov[cnt++].iov_len = (len);                 \
+    } while (0)
+#define IOV_STR(s) IOV_ADD(s, strlen(s))
+
+    IOV_STR("GET ");
+    IOV_ADD(req->path.ptr, req->path.len);
+    IOV_STR(" HTTP/1.0\r\nHost: ");
+    IOV_ADD(req->host.ptr, req->host.len);
+    IOV_STR(":");
+    IOV_STR(port);
+    IOV_STR("\r\n");
+    for (int i = 0; i < req->nheaders; i++)
     {
-        start = uri;
+        const req_header *h = &req->headers[i];
+        //if a client sends any additional request headers as part of an HTTP request, your proxy
+        //should forward them unchanged
+        if (is_replaced_header(h->kind))
+        {
+            continue;
+        }
+        if (run != NULL && run + runlen == h->line)
+        {
+            runlen += h->len;
+            continue;
+        }
+        if (run != NULL)
+        {
+            IOV_ADD(run, runlen);
+        }
+        run = h->line;
+        runlen = h->len;
     }
-    else{
-        start = start + 2; //get to www
+    if (run != NULL)
+    {
+        IOV_ADD(run, runlen);
     }
-    //get the port position using:
-    if ((port_pos = strstr(start, ":")) == NULL)
+    IOV_STR(header_user_agent);
+    IOV_STR(config.keepalive > 0 ? header_connection_keepalive : header_connection);
+    IOV_STR(config.keepalive > 0 ? header_proxy_keepalive : header_proxy);
+    IOV_STR("\r\n");
+#undef IOV_STR
+#undef IOV_ADD
+    return cnt;
+}
+
+bool client_conditional(const http_request *req)
+{
+    for (int i = 0; i < req->nheaders; i++)
     {
-        //port will be "80" by default
-        if ((path_pos = strstr(start, "/") != NULL))
+        const req_header *h = &req->headers[i];
+        if ((h->name_len == 13 && !strncasecmp(h->line, "If-None-Match", 13))
+            || (h->name_len == 17 && !strncasecmp(h->line, "If-Modified-Since", 17)))
         {
-            *path_pos = '\0'; //add termination
-            //extract hostname
-            sscanf(start, "%s", hostname);
-            //extract path only, port has been defaulted to 80
-            *path_pos = '/'; //restore the character from termination null character
-            sscanf(path_pos, "%s", path);
+            return true;
         }
-        else
+    }
+    return false;
+}
+
+/* the validators go in front of the blank line request_iov() ends with,
+two headers of three pieces each and the blank line moved after them */
+int request_iov_validators(struct iovec *iov, int cnt, const cache_block *stale)
+{
+    cnt--;
+    if (stale->etag != NULL)
+    {
+        iov[cnt].iov_base = "If-None-Match: ";
+        iov[cnt++].iov_len = 15;
+        iov[cnt].iov_base = (char *)stale->etag;
+        iov[cnt++].iov_len = stale->etag_len;
+        iov[cnt].iov_base = "\r\n";
+        iov[cnt++].iov_len = 2;
+    }
+    if (stale->last_modified != NULL)
+    {
+        iov[cnt].iov_base = "If-Modified-Since: ";
+        iov[cnt++].iov_len = 19;
+        iov[cnt].iov_base = (char *)stale->last_modified;
+        iov[cnt++].iov_len = stale->last_modified_len;
+        iov[cnt].iov_base = "\r\n";
+        iov[cnt++].iov_len = 2;
+    }
+    iov[cnt].iov_base = "\r\n";
+    iov[cnt++].iov_len = 2;
+    return cnt;
+}
+
+/* conn_connect(), counted and timed in st */
+static int connect_origin(const char *host, const char *port, relay_stats *st)
+{
+    unsigned long start = now_ns();
+    int fd = conn_connect(host, port);
+
+    st->connects++;
+    st->connect_ns += now_ns() - start;
+    return fd;
+}
+
+/* send the request for req to the origin in one writev() (more only if the
+socket takes it in parts); the iovecs come from a. With stale set, it asks
+only for a response newer than that block, by the block's validators */
+static bool send_request(int fd, const http_request *req, const char *port,
+                         const cache_block *stale, arena *a)
+{
+    size_t max = request_iov_max(req) + VALIDATOR_IOV_MAX;
+    struct iovec *iov = arena_alloc(a, max * sizeof(*iov));
+    relay_stats unused; // the request is not part of the response's cost
+    int cnt;
+
+    if (iov == NULL)
+    {
+        return false;
+    }
+    cnt = request_iov(req, port, iov);
+    if (stale != NULL)
+    {
+        cnt = request_iov_validators(iov, cnt, stale);
+    }
+    relay_stats_init(&unused);
+    return relay_writev(fd, iov, cnt, &unused) >= 0;
+}
+
+/* rio_writen() that counts the write() calls it takes and the bytes sent */
+static ssize_t relay_writen(int fd, const char *buf, size_t n, relay_stats *st)
+{
+    size_t left = n;
+    ssize_t written;
+
+    while (left > 0)
+    {
+        written = write(fd, buf, left);
+        st->syscalls++;
+        if (written < 0)
         {
-            // if path_pos is NULL, no file path, only extract file path
-            sscanf(start, "%s", hostname);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
         }
+        left -= written;
+        buf += written;
+        relay_stats_sent(st, written);
     }
-    //port_pos is not NULL
-    else
+    return n;
+}
+
+/* writev() until every iovec is out, counting calls and bytes like
+relay_writen(); iov is used up in the process */
+static ssize_t relay_writev(int fd, struct iovec *iov, int cnt, relay_stats *st)
+{
+    size_t total = 0;
+    ssize_t written;
+
+    while (cnt > 0)
     {
-        // add termination
-        *port_pos = '\0';
-        //extract hostname
-        sscanf(start, "%s", hostname);
-        //extract port and path
-        sscanf(port_pos + 1, "%d%s", port, path);
+        written = writev(fd, iov, cnt);
+        st->syscalls++;
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+        relay_stats_sent(st, written);
+        while (cnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
 
+/* send the first n bytes of a response, its whole head included, to a
+client that wants to keep the connection. The head goes out with our
+Connection header in place of the origin's, but only if the response says
+how long it is; otherwise it is sent as is and the client must see the
+connection close. Returns true if the connection can stay open */
+static bool send_head(int fd, const char *data, size_t n, const upstream_framing *f,
+                      relay_stats *st)
+{
+    struct iovec iov[RESPONSE_IOV_MAX + 1];
+    int cnt = 0;
+
+    if (f->state != UPSTREAM_HEAD && f->state != UPSTREAM_UNTIL_CLOSE)
+    {
+        cnt = response_head_iov(data, f->head_len, iov, RESPONSE_IOV_MAX);
     }
-    
-    
+    if (cnt == 0)
+    {
+        relay_writen(fd, data, n, st);
+        return false;
+    }
+    iov[cnt].iov_base = (char *)data + f->head_len;
+    iov[cnt].iov_len = n - f->head_len;
+    return relay_writev(fd, iov, cnt + 1, st) >= 0;
 }
 
+/* send a complete response held in memory (a cache hit); returns true if
+the client connection can stay open after it */
+static bool send_stored(int fd, const char *data, size_t size, bool keepalive,
+                        relay_stats *st)
+{
+    upstream_framing f;
 
+    if (keepalive)
+    {
+        upstream_framing_init(&f);
+        upstream_frame(&f, data, size);
+        if (upstream_frame_done(&f))
+        {
+            return send_head(fd, data, size, &f, st);
+        }
+    }
+    relay_writen(fd, data, size, st);
+    return false;
+}
+
+/* each thread keeps one pipe for splice(), closed when the thread exits */
+#define RELAY_PIPE_SIZE 65536
+static pthread_key_t relay_pipe_key;
+static pthread_once_t relay_pipe_once = PTHREAD_ONCE_INIT;
+
+static void relay_pipe_free(void *vp)
+{
+    int *pipefd = vp;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    free(pipefd);
+}
+
+static void relay_pipe_key_init(void)
+{
+    pthread_key_create(&relay_pipe_key, relay_pipe_free);
+}
+
+static int *relay_pipe(void)
+{
+    pthread_once(&relay_pipe_once, relay_pipe_key_init);
+    int *pipefd = pthread_getspecific(relay_pipe_key);
+    if (pipefd == NULL && (pipefd = malloc(2 * sizeof(int))) != NULL)
+    {
+        if (pipe(pipefd) < 0)
+        {
+            free(pipefd);
+            return NULL;
+        }
+        pthread_setspecific(relay_pipe_key, pipefd);
+    }
+    return pipefd;
+}
 
-void generate_header(char *header, char* hostname, int* port, char* path, rio_t* rio_client)
+/* move up to max bytes of the response from the origin to the client
+through this thread's pipe without them ever entering user space. Returns
+the bytes moved, fewer than max only if the origin closed, or -1 on error;
+errno EINVAL or ENOSYS means splice() does not work on these descriptors,
+nothing was moved and the caller should copy instead */
+static ssize_t relay_splice(int from, int to, size_t max, relay_stats *st)
 {
-    char buf[MAXLINE]; // create a buf for reading client's request headers
-    /*check host header and get other request header for client rio then change it */
-    sprintf(header, "GET %s HTTP/1.0\r\n", path);
-    while(rio_readlineb(rio_client, buf, MAXLINE) >0){
-        if(strcmp(buf, "\r\n") ==0)
+    int *pipefd = relay_pipe();
+    size_t moved = 0;
+    ssize_t n, m;
+
+    if (pipefd == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    while (moved < max)
+    {
+        n = splice(from, NULL, pipefd[1], NULL,
+                   max - moved < RELAY_PIPE_SIZE ? max - moved : RELAY_PIPE_SIZE,
+                   SPLICE_F_MOVE);
+        st->syscalls++;
+        if (n < 0 && errno == EINTR)
         {
-            break;
+            continue;
+        }
+        if (n < 0)
+        {
+            return -1;
         }
-        /* if a client sends any additional request headers as part of an HTTP request, your proxy 
-        should forward them unchanged.*/
-        if (strstr(buf,"Host:") != NULL)
+        if (n == 0)
         {
-            continue; 
+            break;
         }
-        if (strstr(buf,"User-Agent:") != NULL)
+        moved += n;
+        while (n > 0)
         {
-            continue; 
+            m = splice(pipefd[0], NULL, to, NULL, n, SPLICE_F_MOVE);
+            st->syscalls++;
+            if (m < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (m < 0)
+            {
+                // the pipe still holds bytes for this client: start over
+                // with a fresh one on the next response
+                pthread_setspecific(relay_pipe_key, NULL);
+                relay_pipe_free(pipefd);
+                return -1;
+            }
+            n -= m;
+            relay_stats_sent(st, m);
         }
-        if (strstr(buf,"Connection:") != NULL) 
+    }
+    return moved;
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void relay_stats_init(relay_stats *st)
+{
+    st->start = now_ns();
+    st->sent = 0;
+    st->copied = 0;
+    st->syscalls = 0;
+    st->connects = 0;
+    st->connect_ns = 0;
+    st->first_byte = 0;
+    st->saved = 0;
+    st->arena = NULL;
+}
+
+void relay_stats_sent(relay_stats *st, size_t n)
+{
+    if (st->sent == 0 && n > 0)
+    {
+        st->first_byte = now_ns();
+    }
+    st->sent += n;
+}
+
+bool request_target_make(const http_request *req, arena *a, request_target *t)
+{
+    char port[8];
+    int portlen = snprintf(port, sizeof(port), "%d", req->port);
+    // host ":" port path and the NUL, or as much as cache_make_key() would
+    // ever write: the key takes no more than it needs
+    size_t keylen = req->host.len + 1 + portlen + req->path.len + 1;
+
+    if (keylen > CACHE_KEYLEN)
+    {
+        keylen = CACHE_KEYLEN;
+    }
+    t->host = arena_strndup(a, req->host.ptr, req->host.len);
+    t->port = arena_strndup(a, port, portlen);
+    t->key = arena_alloc(a, keylen);
+    if (t->host == NULL || t->port == NULL || t->key == NULL)
+    {
+        return false;
+    }
+    if (!cache_make_key(t->key, t->host, t->port, req->path.ptr, req->path.len))
+    {
+        t->key = NULL;
+    }
+    return true;
+}
+
+bool client_keepalive(const http_request *req)
+{
+    bool keepalive = req_slice_eq(req->version, "HTTP/1.1");
+    // a Connection or Proxy-Connection header overrides what the version implied
+    for (int i = 0; i < req->nheaders; i++)
+    {
+        const req_header *h = &req->headers[i];
+        if (h->kind != HDR_CONNECTION && h->kind != HDR_PROXY_CONNECTION)
         {
             continue;
         }
-        if (strstr(buf,"Proxy-Connection:") != NULL)
+        req_slice value = request_header_value(h);
+        if (req_slice_has_token(value, "close"))
+        {
+            keepalive = false;
+        }
+        else if (req_slice_has_token(value, "keep-alive"))
+        {
+            keepalive = true;
+        }
+    }
+    return keepalive;
+}
+
+/* the hop-by-hop headers dropped from a response; Transfer-Encoding and
+Trailer stay, since the body is relayed with its framing as received */
+static bool is_hop_by_hop(const char *line, size_t len)
+{
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL)
+    {
+        return false;
+    }
+    req_header_kind kind = request_header_kind(line, colon - line);
+    return kind == HDR_CONNECTION || kind == HDR_PROXY_CONNECTION || kind == HDR_KEEP_ALIVE;
+}
+
+int response_head_iov(const char *data, size_t head_len, struct iovec *iov, int max)
+{
+    const char *end = data + head_len;
+    const char *line = memchr(data, '\n', head_len);
+    const char *seg, *eol;
+    int cnt = 0;
+
+    if (line == NULL || max < 3)
+    {
+        return 0;
+    }
+    line++;
+    iov[cnt].iov_base = (char *)data;
+    iov[cnt++].iov_len = line - data;
+    iov[cnt].iov_base = (char *)header_connection_keepalive;
+    iov[cnt++].iov_len = strlen(header_connection_keepalive);
+    // every stretch of headers between two hop-by-hop ones is one piece
+    for (seg = line; line < end; line = eol)
+    {
+        eol = memchr(line, '\n', end - line);
+        eol = eol != NULL ? eol + 1 : end;
+        if (!is_hop_by_hop(line, eol - line))
         {
             continue;
         }
-        //write into header without any change to them
-        sprintf(header,"%s%s", header,buf);
+        if (line > seg)
+        {
+            if (cnt == max)
+            {
+                return 0;
+            }
+            iov[cnt].iov_base = (char *)seg;
+            iov[cnt++].iov_len = line - seg;
+        }
+        seg = eol;
+    }
+    if (end > seg)
+    {
+        if (cnt == max)
+        {
+            return 0;
+        }
+        iov[cnt].iov_base = (char *)seg;
+        iov[cnt++].iov_len = end - seg;
     }
-    /*format the header by making:
-    first line: GET + path
-    second line: Host: hostname  + port
-    third line:  User-Agent: Mozilla/5.0 (X11; Linux x86 64; rv:3.10.0) Gecko/20191101 Firefox/63.01\r\n
-    forth line: Connection: close\r\n
-    fifth line: Proxy-Connection: close\r\n
-    sixth line: \r\n  ->blank line
-    */
-    
-    sprintf(header, "%sHost: %s:%d\r\n",header, hostname,*port);
-    sprintf(header, "%s%s%s%s", header, header_user_agent,header_connection,header_proxy);
-    sprintf(header, "%s\r\n", header);
+    return cnt;
 }
 
+void log_request(const char *key, bool hit, const relay_stats *st)
+{
+    // each thread counts in its own slot, so this costs no contention
+    unsigned long now = now_ns();
+    stats_count(STAT_REQUESTS, 1);
+    stats_count(hit ? STAT_HITS : STAT_MISSES, 1);
+    stats_count(STAT_BYTES_SENT, st->sent);
+    stats_count(STAT_BYTES_COPIED, st->copied);
+    if (st->saved > 0)
+    {
+        stats_count(STAT_NOT_MODIFIED, 1);
+    }
+    if (st->connects > 0)
+    {
+        stats_count(STAT_CONNECTS, st->connects);
+        stats_time(STAT_CONNECT, st->connect_ns);
+    }
+    if (st->sent > 0)
+    {
+        stats_time(STAT_TTFB, st->first_byte - st->start);
+    }
+    stats_time(STAT_TOTAL, now - st->start);
+    if (verbose)
+    {
+        // bytes per microsecond is MB/s
+        unsigned long ns = now - st->start;
+        double mbps = ns > 0 ? st->sent * 1000.0 / ns : 0.0;
+        char mem[96] = "";
+        if (st->arena != NULL)
+        {
+            // the connection's arena, then all of them together
+            arena_stats all;
+            arena_stats_read(&all);
+            snprintf(mem, sizeof(mem), ", arena %zu bytes (high %zu, any %zu,"
+                     " %lu chunks)", st->arena->used, st->arena->high,
+                     all.high, all.chunks);
+        }
+        // how long a restarted proxy took to serve from its cache again
+        static bool first_hit;
+        if (hit && !__atomic_exchange_n(&first_hit, true, __ATOMIC_RELAXED))
+        {
+            fprintf(stderr, "first hit %.2f ms after start\n", (now_ns() - started) / 1e6);
+        }
+        char saved[96] = "";
+        if (st->saved > 0)
+        {
+            cache_stats cs;
+            cache_stats_read(&cs);
+            snprintf(saved, sizeof(saved), ", %zu bytes saved (%lu 304s, %lu bytes)",
+                     st->saved, cs.revalidated, cs.saved);
+        }
+        fprintf(stderr, "%s %s: %zu bytes sent, %zu bytes copied, "
+                "%u syscalls, %u connects, %.1f MB/s%s%s\n",
+                st->saved > 0 ? "304 " : hit ? "HIT " : "MISS",
+                key != NULL ? key : "(not cached)", st->sent, st->copied,
+                st->syscalls, st->connects, mbps, saved, mem);
+    }
+}
 
 /* from text book
  * return error message to client
  */
-void clienterror(int fd, char *cause, char *errnum, 
-         char *shortmsg, char *longmsg) 
-{
-    char buf[MAXLINE], body[MAXBUF];
+void clienterror(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg) {
+    char buf[MAXLINE];
+    char body[MAXBUF];
+    size_t buflen;
+    size_t bodylen;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
-}
+    bodylen = snprintf(body, MAXBUF,
+            "<!DOCTYPE html>\r\n" \
+            "<html>\r\n" \
+            "<head><title>Proxy Error</title></head>\r\n" \
+            "<body bgcolor=\"ffffff\">\r\n" \
+            "<h1>%s: %s</h1>\r\n" \
+            "<p>%s</p>\r\n" \
+            "<hr /><em>The Proxy web server</em>\r\n" \
+            "</body></html>\r\n", \
+            errnum, shortmsg, longmsg);
+    if (bodylen >= MAXBUF) {
+        return; // Overflow!
+    }
+
+    /* Build the HTTP response headers */
+    buflen = snprintf(buf, MAXLINE,
+            "HTTP/1.0 %s %s\r\n" \
+            "Content-Type: text/html\r\n" \
+            "Content-Length: %zu\r\n\r\n", \
+            errnum, shortmsg, bodylen);
+    if (buflen >= MAXLINE) {
+        return; // Overflow!
+    }
 
+    /* Write the headers */
+    if (rio_writen(fd, buf, buflen) < 0) {
+        fprintf(stderr, "Error writing error response headers to client\n");
+        return;
+    }
+
+    /* Write the body */
+    if (rio_writen(fd, body, bodylen) < 0) {
+        fprintf(stderr, "Error writing error response body to client\n");
+        return;
+    }
+}
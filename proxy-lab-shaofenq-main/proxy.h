@@ -0,0 +1,118 @@
+/**
+ * @file proxy.h
+ * @brief Request helpers shared by the proxy's connection models
+ *
+ * proxy.c owns the request handling logic (the header rewrite rules; the
+ * request itself is taken apart by request.c). The threaded handler in proxy.c and the event loop in
+ * evloop.c both build the outgoing request with these functions so the two
+ * models always send the origin exactly the same bytes.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "arena.h"
+#include "cache.h"
+#include "request.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define CLIENT_IDLE_SECS 5  /* default wait for a persistent client's next request */
+#define RESPONSE_IOV_MAX 16 /* pieces a response head may be split into */
+#define REQUEST_IOV_MAX (REQUEST_MAX_HEADERS + 11) /* pieces of any outgoing request */
+#define VALIDATOR_IOV_MAX 6 /* pieces request_iov_validators() adds */
+
+/* command line settings both connection models look at */
+typedef struct {
+    bool coalesce; /* -s: concurrent misses on one key share one fetch */
+    bool splice;   /* uncacheable responses are relayed with splice() (-n: no) */
+    int keepalive; /* -k: idle origin connections kept per host:port */
+    int client_idle; /* -c: seconds a client connection may idle between
+                        requests, 0 to close after every response */
+} proxy_config;
+
+extern proxy_config config;
+
+/* where a request goes, as strings taken from the connection's arena */
+typedef struct {
+    char *host; /* from the URI */
+    char *port; /* the URI's port in decimal */
+    char *key;  /* cache key, NULL if the request is not cached */
+} request_target;
+
+/* Fill in t for req from arena a. Returns false if a cannot hold it */
+bool request_target_make(const http_request *req, arena *a, request_target *t);
+
+/* The iovecs request_iov() may need for req */
+static inline int request_iov_max(const http_request *req)
+{
+    return req->nheaders + 11;
+}
+
+/* The request sent to the origin for req, as iovecs: the request line and
+Host header (port is req->port as a string), the client's other headers
+unchanged, then the fixed proxy headers and the blank line. Nothing is
+copied, the pieces point into req's buffer, port and constant strings.
+Returns the number of iovecs used, at most request_iov_max(req) */
+int request_iov(const http_request *req, const char *port, struct iovec *iov);
+
+/* Make the request request_iov() put in the cnt iovecs at iov conditional
+on stale's validators (If-None-Match, If-Modified-Since), so the origin may
+answer 304 Not Modified instead of sending it again; iov must have room for
+VALIDATOR_IOV_MAX more. Returns the new count */
+int request_iov_validators(struct iovec *iov, int cnt, const cache_block *stale);
+
+/* Whether the client wants its connection kept after req: HTTP/1.1 unless
+a Connection or Proxy-Connection header says otherwise */
+bool client_keepalive(const http_request *req);
+
+/* Whether the client made req conditional itself (If-None-Match or
+If-Modified-Since); a 304 to the proxy's own validators would not answer it */
+bool client_conditional(const http_request *req);
+
+/* Split the response head data[0..head_len) into iovecs that drop its
+hop-by-hop headers (Connection, Proxy-Connection, Keep-Alive) and add
+"Connection: keep-alive" after the status line, which is how a persistent
+client is told the connection stays open. Nothing is copied. Returns the
+number of iovecs used, or 0 if the head does not fit in max of them */
+int response_head_iov(const char *data, size_t head_len, struct iovec *iov,
+                      int max);
+
+/* what relaying one response cost, filled in while it is sent */
+typedef struct {
+    unsigned long start;   /* CLOCK_MONOTONIC ns when the request was read */
+    size_t sent;           /* response bytes written to the client */
+    size_t copied;         /* bytes copied in user space: the request head,
+                              and response bytes relayed through a scratch
+                              buffer instead of the cache entry or a pipe */
+    unsigned int syscalls; /* read()s and write()s spent moving the response */
+    unsigned int connects; /* new origin connections opened for it */
+    unsigned long connect_ns; /* time those took, the lookups included */
+    unsigned long first_byte; /* CLOCK_MONOTONIC ns the first byte went out */
+    size_t saved;          /* bytes a 304 spared the origin sending again */
+    const arena *arena;    /* the connection's, for its high-water mark */
+} relay_stats;
+
+/* Start measuring a response */
+void relay_stats_init(relay_stats *st);
+
+/* Count n more response bytes written to the client */
+void relay_stats_sent(relay_stats *st, size_t n);
+
+/* With -v, log one line per request: bytes sent, bytes copied, the read and
+write calls and origin connects it took, the rate from request to last
+byte, and what the connection's arena holds and has held at most (with the
+highest mark of any arena and the chunks malloc()ed for all of them). The
+first hit also logs how long after startup it came, which is how soon a
+restarted proxy serves from a restored cache. A stale hit revalidated by a
+304 is logged as such, with the bytes it saved and the total so far. With
+or without -v, the request is counted for /proxy-stats (stats.h) */
+void log_request(const char *key, bool hit, const relay_stats *st);
+
+/* Send an HTML error page to the client */
+void clienterror(int fd, const char *errnum, const char *shortmsg,
+                 const char *longmsg);
+
+#endif /* PROXY_H */
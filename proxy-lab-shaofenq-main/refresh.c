@@ -0,0 +1,249 @@
+/*
+ * refresh.c - background refreshes of stale cache entries (-r)
+ *
+ * Stale blocks wait in a fixed ring guarded by one mutex, which is only
+ * held to add or take an entry; a request that finds the ring full moves
+ * on without waiting. Each queued block carries its own reference, so an
+ * eviction meanwhile does not free it under the worker.
+ *
+ * A worker rebuilds the request from the block's key (host:port/path) with
+ * request_iov(), the way a client request without headers of its own would
+ * be sent, adds the block's validators and reads the response into a
+ * cache_pending. It takes a pooled origin connection with -k and puts it
+ * back when the response was framed to its end; a pooled one that turns
+ * out to be closed is replaced by a new connection once, as on the request
+ * path. Only a 304 or a 200 touches the cache, so an origin error does not
+ * replace a good copy.
+ */
+
+#define _GNU_SOURCE /* memrchr */
+
+#include "cache.h"
+#include "conn.h"
+#include "csapp.h"
+#include "proxy.h"
+#include "refresh.h"
+#include "upstream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static cache_block *queue[REFRESH_QUEUE];
+static int queue_head, queue_len;
+static bool enabled;
+static refresh_counts counts; /* updated atomically */
+
+/* what one attempt at a refresh came to */
+typedef enum {
+    FETCH_DONE,   /* the cache has been updated */
+    FETCH_FAILED, /* nothing to update it with */
+    FETCH_CLOSED  /* the connection was closed before anything came back */
+} fetch_result;
+
+/* write out every iovec, false if the connection fails */
+static bool send_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/* send the request in iov on fd and update b from the response; with
+framing done, fd may be reused */
+static fetch_result fetch(int fd, cache_block *b, struct iovec *iov, int cnt,
+                          upstream_framing *f)
+{
+    char buf[MAXLINE];
+    cache_pending pending;
+    struct pollfd pfd = {fd, POLLIN, 0};
+    size_t got = 0;
+
+    if (!send_all(fd, iov, cnt)) {
+        return FETCH_CLOSED;
+    }
+    cache_pending_init(&pending, true);
+    upstream_framing_init(f);
+    while (!upstream_frame_done(f)) {
+        size_t space, used;
+        char *chunk;
+        ssize_t n;
+        int ready = poll(&pfd, 1, REFRESH_TIMEOUT_SECS * 1000);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            break;
+        }
+        chunk = cache_pending_space(&pending, buf, sizeof(buf), &space);
+        if ((n = read(fd, chunk, space)) < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0 && got == 0) {
+                cache_pending_abort(&pending);
+                return FETCH_CLOSED;
+            }
+            if (n == 0) {
+                upstream_frame_eof(f);
+            }
+            break;
+        }
+        got += n;
+        if ((used = upstream_frame(f, chunk, n)) < (size_t)n) {
+            f->keepalive = false; /* more than the response: do not reuse */
+        }
+        cache_pending_append(&pending, chunk, used);
+        if (f->state != UPSTREAM_HEAD && f->status != 200 && f->status != 304) {
+            break;
+        }
+    }
+    if (!upstream_frame_done(f) || pending.data == NULL) {
+        cache_pending_abort(&pending);
+        return FETCH_FAILED;
+    }
+    if (f->status == 304) {
+        cache_refresh(b, pending.data, pending.size);
+        cache_pending_abort(&pending);
+        __atomic_add_fetch(&counts.refreshed, 1, __ATOMIC_RELAXED);
+    } else {
+        /* a new copy: inserting it replaces the stale block */
+        cache_pending_commit(&pending, b->key);
+        __atomic_add_fetch(&counts.replaced, 1, __ATOMIC_RELAXED);
+    }
+    return FETCH_DONE;
+}
+
+/* fetch b's key from its origin again and update the cache from it */
+static void refresh(cache_block *b)
+{
+    const char *slash = strchr(b->key, '/');
+    const char *colon = slash != NULL ? memrchr(b->key, ':', slash - b->key) : NULL;
+    char host[REQUEST_HOSTLEN], port[8];
+    struct iovec iov[REQUEST_IOV_MAX + VALIDATOR_IOV_MAX];
+    http_request req;
+    upstream_framing f;
+    fetch_result result = FETCH_FAILED;
+    bool pooled = config.keepalive > 0;
+
+    /* the key is host:port/path, see cache_make_key() */
+    if (colon == NULL || (size_t)(colon - b->key) >= sizeof(host)
+        || (size_t)(slash - colon - 1) >= sizeof(port)) {
+        __atomic_add_fetch(&counts.failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - b->key), b->key);
+    snprintf(port, sizeof(port), "%.*s", (int)(slash - colon - 1), colon + 1);
+    memset(&req, 0, sizeof(req));
+    req.host.ptr = b->key;
+    req.host.len = colon - b->key;
+    req.path.ptr = slash;
+    req.path.len = strlen(slash);
+    req.port = atoi(port);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int fd = pooled && attempt == 0 ? upstream_take(host, port) : -1;
+        bool reused = fd >= 0;
+        if (!reused && (fd = conn_connect(host, port)) < 0) {
+            break;
+        }
+        int cnt = request_iov_validators(iov, request_iov(&req, port, iov), b);
+        result = fetch(fd, b, iov, cnt, &f);
+        if (result == FETCH_DONE && pooled && f.keepalive && upstream_frame_done(&f)) {
+            upstream_put(host, port, fd);
+        } else {
+            close(fd);
+        }
+        if (result != FETCH_CLOSED || !reused) {
+            break;
+        }
+    }
+    if (result != FETCH_DONE) {
+        __atomic_add_fetch(&counts.failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *refresh_worker(void *vargp)
+{
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_len == 0) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        cache_block *b = queue[queue_head];
+        queue_head = (queue_head + 1) % REFRESH_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        refresh(b);
+        /* a block that is still cached and still stale may be queued again */
+        __atomic_store_n(&b->refreshing, false, __ATOMIC_RELEASE);
+        cache_release(b);
+    }
+    return NULL;
+}
+
+void refresh_init(int workers)
+{
+    pthread_t tid;
+
+    enabled = workers > 0;
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&tid, NULL, refresh_worker, NULL);
+    }
+}
+
+bool refresh_stale(cache_block *block)
+{
+    if (!enabled) {
+        return false;
+    }
+    if (__atomic_exchange_n(&block->refreshing, true, __ATOMIC_ACQ_REL)) {
+        return true; /* someone queued it already */
+    }
+    pthread_mutex_lock(&queue_lock);
+    if (queue_len == REFRESH_QUEUE) {
+        pthread_mutex_unlock(&queue_lock);
+        __atomic_store_n(&block->refreshing, false, __ATOMIC_RELEASE);
+        return true;
+    }
+    cache_retain(block);
+    queue[(queue_head + queue_len++) % REFRESH_QUEUE] = block;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    __atomic_add_fetch(&counts.queued, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void refresh_stats(refresh_counts *c)
+{
+    c->queued = __atomic_load_n(&counts.queued, __ATOMIC_RELAXED);
+    c->refreshed = __atomic_load_n(&counts.refreshed, __ATOMIC_RELAXED);
+    c->replaced = __atomic_load_n(&counts.replaced, __ATOMIC_RELAXED);
+    c->failed = __atomic_load_n(&counts.failed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+/**
+ * @file refresh.h
+ * @brief Stale-while-revalidate: refreshing expired cache entries off the
+ * request path
+ *
+ * When an entry goes stale, the request that finds it waits for the origin
+ * to revalidate or resend it, and so does every other request for it in
+ * the meantime. With -r the stale copy is sent straight away instead, and
+ * the entry is handed to a small pool of refresh workers that fetch it
+ * again behind the clients' backs: conditionally when it has a validator,
+ * so an unchanged object costs a 304. A 304 makes the entry fresh in
+ * place; a new 200 is cached, replacing the stale block the way any insert
+ * does, so readers see either the old block or the new one, never a mix.
+ *
+ * An entry is refreshed by one worker at a time: the first request to find
+ * it stale queues it, and the ones after only serve it. When the queue is
+ * full nothing is queued and a later request tries again.
+ */
+
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include "cache.h"
+
+#include <stdbool.h>
+
+#define REFRESH_QUEUE 64        /* entries waiting for a refresh worker */
+#define REFRESH_TIMEOUT_SECS 10 /* an origin silent this long is given up */
+
+/* what the refresh workers did */
+typedef struct {
+    unsigned long queued;    /* stale entries handed to them */
+    unsigned long refreshed; /* made fresh again by a 304 */
+    unsigned long replaced;  /* fetched again in full */
+    unsigned long failed;    /* origin unreachable or it sent something else */
+} refresh_counts;
+
+/* Start workers refresh threads; with 0, refresh_stale() never takes a
+block and stale entries are revalidated on the request path */
+void refresh_init(int workers);
+
+/* A request found block stale. Returns true if it may be served as it is,
+because a refresh of it has been queued (taking a reference of its own) or
+one is already under way; false if there are no refresh workers */
+bool refresh_stale(cache_block *block);
+
+/* The counts so far */
+void refresh_stats(refresh_counts *c);
+
+#endif /* REFRESH_H */
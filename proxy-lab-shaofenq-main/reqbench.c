@@ -0,0 +1,407 @@
+/*
+ * reqbench.c - requests/sec of request_parser_feed() against the old parsing
+ *
+ * The old way is what serve_request() did before request.c: sscanf() the
+ * request line into MAXLINE buffers, parse_uri() with strstr() and
+ * sscanf(), then strstr() every header line for the names the proxy
+ * replaces and strcasestr() the connection headers. Both sides take apart
+ * the same request heads held in memory, so only parsing is measured;
+ * request_parser_feed() is timed with each scanner scan.c has on this CPU.
+ *
+ * The second part reads the same heads back from a file through a rio_t,
+ * the way tiny's read_requesthdrs() gets them off a socket: a line at a
+ * time with rio_readlineb() and sscanf(), against scan_readlineb() and the
+ * scanners. That one is reported in ns per request.
+ *
+ * The third part hands the parser each head in pieces, as a non-blocking
+ * socket would: once starting over from the first byte on every piece, as
+ * the event loop did before it kept a request_parser per connection, and
+ * once resuming where the last piece left off.
+ *
+ * The malloc() calls made while parsing are counted by the wrappers below
+ * (glibc only): a parser in the style of http_parser.h, with parser_new()
+ * and parser_free() per request and a copy of every string it hands out,
+ * would show at least one per header here. The parser's header tables come
+ * from an arena reset before every head, as the proxy's connections do, so
+ * once it has its chunk there should be none.
+ *
+ * Not part of the proxy (listed in .tarignore); build and run with
+ *     gcc -O2 -std=c99 -D_GNU_SOURCE -I. reqbench.c request.c scan.c \
+ *         arena.c csapp.c -o reqbench -lpthread
+ *     ./reqbench [iterations]
+ */
+
+#include "csapp.h"
+#include "request.h"
+#include "scan.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *heads[] = {
+    "GET http://localhost:18081/home.html HTTP/1.0\r\n"
+    "Host: localhost:18081\r\n"
+    "\r\n",
+
+    "GET http://www.example.com/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "\r\n",
+
+    "GET http://cdn.example.org:8080/static/js/app.min.js?v=3 HTTP/1.1\r\n"
+    "Host: cdn.example.org:8080\r\n"
+    "User-Agent: curl/7.81.0\r\n"
+    "Accept: */*\r\n"
+    "X-Forwarded-For: 10.0.0.1\r\n"
+    "If-None-Match: \"5e1f-3a\"\r\n"
+    "\r\n",
+
+    "GET http://news.example.com/api/v2/articles?page=2&sort=recent HTTP/1.1\r\n"
+    "Host: news.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: application/json, text/plain, */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Referer: http://news.example.com/world/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "Cookie: _ga=GA1.2.1234567890.1697000000; _gid=GA1.2.987654321.1697500000; "
+    "consent=yes; region=eu-west\r\n"
+    "\r\n",
+};
+#define NHEADS (sizeof(heads) / sizeof(heads[0]))
+
+/* count every allocation the program makes */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static unsigned long nallocs;
+
+void *malloc(size_t size)
+{
+    nallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    nallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    nallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+/* one parser and arena for the whole run, as a connection keeps them */
+static request_parser parser;
+static arena mem;
+
+/* the old parse_uri(), verbatim apart from layout */
+static void old_parse_uri(char *uri, char *hostname, int *port, char *path)
+{
+    char *start, *port_pos, *path_pos;
+
+    *port = 80;
+    hostname[0] = '\0';
+    strcpy(path, "/");
+    if ((start = strstr(uri, "//")) == NULL) {
+        start = uri;
+    } else {
+        start = start + 2;
+    }
+    if ((port_pos = strstr(start, ":")) == NULL) {
+        if ((path_pos = strstr(start, "/")) != NULL) {
+            *path_pos = '\0';
+            sscanf(start, "%s", hostname);
+            *path_pos = '/';
+            sscanf(path_pos, "%s", path);
+        } else {
+            sscanf(start, "%s", hostname);
+        }
+    } else {
+        *port_pos = '\0';
+        sscanf(start, "%s", hostname);
+        sscanf(port_pos + 1, "%d%s", port, path);
+    }
+}
+
+static int old_parse(const char *head)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char hostname[MAXLINE], path[MAXLINE];
+    int port, forwarded = 0;
+    const char *line = head, *eol;
+
+    /* the old code read a line at a time into buf with rio_readlineb() */
+    eol = strstr(line, "\r\n") + 2;
+    memcpy(buf, line, eol - line);
+    buf[eol - line] = '\0';
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) {
+        return -1;
+    }
+    old_parse_uri(uri, hostname, &port, path);
+    int keepalive = !strcmp(version, "HTTP/1.1");
+    for (line = eol; strncmp(line, "\r\n", 2); line = eol) {
+        eol = strstr(line, "\r\n") + 2;
+        memcpy(buf, line, eol - line);
+        buf[eol - line] = '\0';
+        if (!strncasecmp(buf, "Connection:", 11)
+            || !strncasecmp(buf, "Proxy-Connection:", 17)) {
+            if (strcasestr(buf, "close") != NULL) {
+                keepalive = 0;
+            } else if (strcasestr(buf, "keep-alive") != NULL) {
+                keepalive = 1;
+            }
+        }
+        if (strstr(buf, "Host:") == NULL && strstr(buf, "User-Agent:") == NULL
+            && strstr(buf, "Connection:") == NULL
+            && strstr(buf, "Proxy-Connection:") == NULL) {
+            forwarded++;
+        }
+    }
+    return port + forwarded + keepalive;
+}
+
+static int new_parse(const char *head, size_t len)
+{
+    const http_request *req = &parser.req;
+    int forwarded = 0;
+
+    arena_reset(&mem);
+    request_parser_reset(&parser);
+    if (request_parser_feed(&parser, head, len) <= 0) {
+        return -1;
+    }
+    int keepalive = req_slice_eq(req->version, "HTTP/1.1");
+    for (int i = 0; i < req->nheaders; i++) {
+        const req_header *h = &req->headers[i];
+        if (h->kind == HDR_CONNECTION || h->kind == HDR_PROXY_CONNECTION) {
+            req_slice v = request_header_value(h);
+            if (req_slice_has_token(v, "close")) {
+                keepalive = 0;
+            } else if (req_slice_has_token(v, "keep-alive")) {
+                keepalive = 1;
+            }
+        }
+        if (h->kind != HDR_HOST && h->kind != HDR_USER_AGENT
+            && h->kind != HDR_CONNECTION && h->kind != HDR_PROXY_CONNECTION) {
+            forwarded++;
+        }
+    }
+    return req->port + forwarded + keepalive;
+}
+
+/* tiny's read_requesthdrs() as it was: rio_readlineb() and sscanf() */
+static int old_read(rio_t *rp)
+{
+    char buf[MAXLINE], name[MAXLINE], value[MAXLINE];
+    char method[MAXLINE], uri[MAXLINE], version;
+    int n = 0;
+
+    if (rio_readlineb(rp, buf, sizeof(buf)) <= 0
+        || sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3) {
+        return -1;
+    }
+    while (rio_readlineb(rp, buf, sizeof(buf)) > 0 && strcmp(buf, "\r\n")) {
+        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
+            return -1;
+        }
+        n += tolower((unsigned char)name[0]) + value[0];
+    }
+    return n;
+}
+
+/* and as it is now: scan_readlineb() and the scanners */
+static int new_read(rio_t *rp)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version;
+    ssize_t len;
+    int n = 0;
+
+    if (scan_readlineb(rp, buf, sizeof(buf)) <= 0
+        || sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3) {
+        return -1;
+    }
+    while ((len = scan_readlineb(rp, buf, sizeof(buf))) > 0
+           && strcmp(buf, "\r\n")) {
+        char *end = buf + len;
+        char *colon = (char *)scan_find(buf, end, ':');
+        if (colon == buf || colon == end) {
+            return -1;
+        }
+        char *value = colon + 1;
+        while (value < end && isspace((unsigned char)*value)) {
+            value++;
+        }
+        char *value_end = (char *)scan_find2(value, end, '\r', '\n');
+        if (value_end == value) {
+            return -1;
+        }
+        *colon = *value_end = '\0';
+        n += tolower((unsigned char)buf[0]) + value[0];
+    }
+    return n;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_parse(long iters, const size_t *lens, volatile long *sink)
+{
+    double t = now_sec();
+    for (long i = 0; i < iters; i++) {
+        size_t k = i % NHEADS;
+        *sink += new_parse(heads[k], lens[k]);
+    }
+    return now_sec() - t;
+}
+
+/* ns per head to parse every head arriving piece bytes at a time, starting
+over on each piece or resuming */
+static double time_pieces(long iters, const size_t *lens, size_t piece,
+                          bool resume, volatile long *sink)
+{
+    double t = now_sec();
+    for (long i = 0; i < iters; i++) {
+        size_t k = i % NHEADS;
+        long n = 0;
+        arena_reset(&mem);
+        request_parser_reset(&parser);
+        for (size_t got = piece; n == 0; got += piece) {
+            if (!resume) {
+                request_parser_reset(&parser);
+            }
+            n = request_parser_feed(&parser, heads[k],
+                                    got < lens[k] ? got : lens[k]);
+        }
+        *sink += n;
+    }
+    return (now_sec() - t) * 1e9 / iters;
+}
+
+/* ns per head to read every head in fd, iters times over */
+static double time_read(int fd, long iters, int (*read_head)(rio_t *),
+                        volatile long *sink)
+{
+    rio_t rio;
+    double t = now_sec();
+    for (long i = 0; i < iters; i += NHEADS) {
+        lseek(fd, 0, SEEK_SET);
+        rio_readinitb(&rio, fd);
+        for (size_t k = 0; k < NHEADS; k++) {
+            *sink += read_head(&rio);
+        }
+    }
+    return (now_sec() - t) * 1e9 / iters;
+}
+
+int main(int argc, char **argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    size_t lens[NHEADS];
+    volatile long sink = 0;
+    double t;
+
+    arena_init(&mem);
+    request_parser_init(&parser, &mem);
+    for (size_t k = 0; k < NHEADS; k++) {
+        lens[k] = strlen(heads[k]);
+        if (old_parse(heads[k]) != new_parse(heads[k], lens[k])) {
+            fprintf(stderr, "parsers disagree on request %zu\n", k);
+            return 1;
+        }
+    }
+
+    unsigned long allocs = nallocs;
+    t = now_sec();
+    for (long i = 0; i < iters; i++) {
+        sink += old_parse(heads[i % NHEADS]);
+    }
+    double old_secs = now_sec() - t;
+
+    static const char *impls[] = {"avx2", "sse2", "scalar"};
+    printf("parsing heads in memory, %ld requests:\n", iters);
+    printf("  %-24s %10.0f requests/sec  %.2f allocations/request\n",
+           "sscanf/strstr", iters / old_secs,
+           (double)(nallocs - allocs) / iters);
+    for (size_t j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        char label[64];
+        if (!scan_use(impls[j])) {
+            continue;
+        }
+        allocs = nallocs;
+        double secs = time_parse(iters, lens, &sink);
+        snprintf(label, sizeof(label), "request_parser [%s]", impls[j]);
+        printf("  %-24s %10.0f requests/sec  %.2f allocations/request "
+               "(%.1fx)\n", label, iters / secs,
+               (double)(nallocs - allocs) / iters, old_secs / secs);
+    }
+
+    /* the heads back to back in a file, read through rio */
+    char path[] = "/tmp/reqbenchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    for (size_t k = 0; k < NHEADS; k++) {
+        if (write(fd, heads[k], lens[k]) != (ssize_t)lens[k]) {
+            perror("write");
+            return 1;
+        }
+    }
+    printf("reading heads through rio, %ld requests:\n", iters);
+    printf("  %-36s %7.1f ns/request\n", "rio_readlineb + sscanf (before)",
+           time_read(fd, iters, old_read, &sink));
+    for (size_t j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+        char label[64];
+        if (!scan_use(impls[j])) {
+            continue;
+        }
+        snprintf(label, sizeof(label), "scan_readlineb + scan_find [%s]",
+                 impls[j]);
+        printf("  %-36s %7.1f ns/request\n", label,
+               time_read(fd, iters, new_read, &sink));
+    }
+    close(fd);
+
+    for (size_t j = 0; !scan_use(impls[j]); j++) {
+        /* back to the best one there is */
+    }
+    printf("parsing heads arriving in pieces [%s], %ld requests:\n",
+           scan_impl(), iters);
+    static const size_t pieces[] = {1460, 64, 16};
+    for (size_t j = 0; j < sizeof(pieces) / sizeof(pieces[0]); j++) {
+        double scratch = time_pieces(iters, lens, pieces[j], false, &sink);
+        double resumed = time_pieces(iters, lens, pieces[j], true, &sink);
+        printf("  %4zu byte pieces: %7.1f ns/request from scratch, "
+               "%7.1f resumed\n", pieces[j], scratch, resumed);
+    }
+    return 0;
+}
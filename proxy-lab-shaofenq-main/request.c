@@ -0,0 +1,304 @@
+/*
+ * request.c - single-pass, in-place parser for request heads
+ *
+ * Every byte of the head is looked at once, even when it comes in pieces:
+ * the parser remembers where the last whole line it saw ended and starts
+ * there on the next call. The scanners in scan.c find the line ends, the
+ * colon after each header name and the words of the request line 16 or 32
+ * bytes at a time. The results point into the caller's buffer.
+ */
+
+#include "request.h"
+#include "scan.h"
+
+#include <string.h>
+#include <strings.h>
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/* the end of a line's content: before the CR of a CRLF, or at the LF */
+static const char *content_end(const char *line, const char *lf)
+{
+    return lf > line && lf[-1] == '\r' ? lf - 1 : lf;
+}
+
+/* the next blank-separated token in [*p, end), moving *p past it */
+static req_slice next_token(const char **p, const char *end)
+{
+    req_slice tok;
+    const char *s = *p;
+    while (s < end && is_blank(*s)) {
+        s++;
+    }
+    tok.ptr = s;
+    s = scan_find2(s, end, ' ', '\t');
+    tok.len = s - tok.ptr;
+    *p = s;
+    return tok;
+}
+
+/* split an absolute URI (or a bare host[:port]/path) into host, port and
+path, as parse_uri() used to. A path alone is a request for the proxy
+itself: the host is left empty */
+static bool parse_uri(http_request *req)
+{
+    const char *p = req->uri.ptr;
+    const char *end = p + req->uri.len;
+    const char *slashes = NULL;
+
+    if (*p == '/' && (end - p < 2 || p[1] != '/')) {
+        req->host.ptr = p;
+        req->host.len = 0;
+        req->port = 80;
+        req->path = req->uri;
+        return true;
+    }
+
+    for (const char *s = p; s + 1 < end; s++) {
+        if (s[0] == '/' && s[1] == '/') {
+            slashes = s;
+            break;
+        }
+    }
+    if (slashes != NULL) {
+        p = slashes + 2;
+    }
+    req->host.ptr = p;
+    while (p < end && *p != ':' && *p != '/') {
+        p++;
+    }
+    req->host.len = p - req->host.ptr;
+    if (req->host.len == 0 || req->host.len >= REQUEST_HOSTLEN) {
+        return false;
+    }
+
+    req->port = 80;
+    if (p < end && *p == ':') {
+        int port = 0, digits = 0;
+        for (p++; p < end && *p >= '0' && *p <= '9' && digits < 6; p++) {
+            port = port * 10 + (*p - '0');
+            digits++;
+        }
+        if (digits == 0 || port < 1 || port > 65535
+            || (p < end && *p != '/')) {
+            return false;
+        }
+        req->port = port;
+    }
+
+    if (p < end) {
+        req->path.ptr = p;
+        req->path.len = end - p;
+    } else {
+        req->path.ptr = "/";
+        req->path.len = 1;
+    }
+    return true;
+}
+
+static bool parse_request_line(http_request *req, const char *p,
+                               const char *end)
+{
+    req->method = next_token(&p, end);
+    req->uri = next_token(&p, end);
+    req->version = next_token(&p, end);
+    if (req->method.len == 0 || req->uri.len == 0 || req->version.len == 0) {
+        return false;
+    }
+    return parse_uri(req);
+}
+
+static void parse_header(req_header *h, const char *line, const char *colon,
+                         const char *stop, const char *next)
+{
+    const char *v, *vend;
+
+    h->line = line;
+    h->len = next - line;
+    if (colon == stop) {
+        /* not a header at all: passed on untouched like any other */
+        h->name_len = h->value_off = h->value_len = 0;
+        h->kind = HDR_OTHER;
+        return;
+    }
+    h->name_len = colon - line;
+    h->kind = request_header_kind(line, h->name_len);
+    for (v = colon + 1; v < stop && is_blank(*v); v++) {
+    }
+    for (vend = stop; vend > v && is_blank(vend[-1]); vend--) {
+    }
+    h->value_off = v - line;
+    h->value_len = vend - v;
+}
+
+/* a bigger table for the headers: first as many as the last request had
+(and a few more), then twice that, up to REQUEST_MAX_HEADERS */
+static bool grow_headers(request_parser *p)
+{
+    int room = p->room > 0 ? 2 * p->room : p->expect + 8;
+    req_header *headers;
+
+    if (room > REQUEST_MAX_HEADERS) {
+        room = REQUEST_MAX_HEADERS;
+    }
+    if (room <= p->room) {
+        return false;
+    }
+    if ((headers = arena_alloc(p->arena, room * sizeof(req_header))) == NULL) {
+        return false;
+    }
+    if (p->req.nheaders > 0) {
+        memcpy(headers, p->req.headers, p->req.nheaders * sizeof(req_header));
+    }
+    p->req.headers = headers;
+    p->room = room;
+    return true;
+}
+
+/* one line of the head, from line up to stop where its line ending is,
+next after that: the request line first, then a header each */
+static parser_state parse_line(request_parser *p, const char *line,
+                               const char *stop, const char *next)
+{
+    http_request *req = &p->req;
+
+    if (!p->started) {
+        p->started = true;
+        return parse_request_line(req, line, stop) ? REQUEST : ERROR;
+    }
+    if ((req->nheaders == p->room && !grow_headers(p))
+        || next - line > UINT16_MAX) {
+        return ERROR;
+    }
+    /* the name ends at the first colon; only the name is scanned for it */
+    parse_header(&req->headers[req->nheaders++], line,
+                 scan_find(line, stop, ':'), stop, next);
+    return HEADER;
+}
+
+void request_parser_init(request_parser *p, arena *a)
+{
+    p->arena = a;
+    p->expect = 0;
+    p->complete = false;
+    request_parser_reset(p);
+}
+
+void request_parser_reset(request_parser *p)
+{
+    if (p->complete) {
+        p->expect = p->req.nheaders;
+    }
+    p->req.nheaders = 0;
+    p->req.headers = NULL;
+    p->room = 0;
+    p->done = 0;
+    p->started = false;
+    p->complete = false;
+    p->state = REQUEST;
+}
+
+long request_parser_feed(request_parser *p, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+
+    if (p->state == ERROR) {
+        return -1;
+    }
+    if (p->complete) {
+        return p->done;
+    }
+    while (p->done < len) {
+        const char *line = buf + p->done;
+        const char *lf = scan_find(line, end, '\n');
+        if (lf == end) {
+            return 0; /* the rest of this line is still to come */
+        }
+        const char *stop = content_end(line, lf);
+        p->done = lf + 1 - buf;
+        if (stop == line && p->started) {
+            p->complete = true; /* the blank line */
+            return p->done;
+        }
+        if ((p->state = parse_line(p, line, stop, lf + 1)) == ERROR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* kind if name is lit, ignoring case; len already matches */
+static req_header_kind match(const char *name, const char *lit,
+                             req_header_kind kind)
+{
+    return strncasecmp(name, lit, strlen(lit)) ? HDR_OTHER : kind;
+}
+
+req_header_kind request_header_kind(const char *name, size_t len)
+{
+    char first = name[0] | 0x20; /* ASCII lower case */
+
+    switch (len) {
+    case 2:
+        return match(name, "TE", HDR_TE);
+    case 4:
+        return match(name, "Host", HDR_HOST);
+    case 7:
+        if (first == 't') {
+            return match(name, "Trailer", HDR_TRAILER);
+        }
+        return first == 'u' ? match(name, "Upgrade", HDR_UPGRADE) : HDR_OTHER;
+    case 10:
+        switch (first) {
+        case 'c':
+            return match(name, "Connection", HDR_CONNECTION);
+        case 'k':
+            return match(name, "Keep-Alive", HDR_KEEP_ALIVE);
+        case 'u':
+            return match(name, "User-Agent", HDR_USER_AGENT);
+        default:
+            return HDR_OTHER;
+        }
+    case 16:
+        return match(name, "Proxy-Connection", HDR_PROXY_CONNECTION);
+    case 17:
+        return match(name, "Transfer-Encoding", HDR_TRANSFER_ENCODING);
+    case 18:
+        return match(name, "Proxy-Authenticate", HDR_PROXY_AUTHENTICATE);
+    case 19:
+        return match(name, "Proxy-Authorization", HDR_PROXY_AUTHORIZATION);
+    default:
+        return HDR_OTHER;
+    }
+}
+
+bool req_slice_eq(req_slice s, const char *str)
+{
+    return strlen(str) == s.len && !strncasecmp(s.ptr, str, s.len);
+}
+
+bool req_slice_has_token(req_slice s, const char *token)
+{
+    const char *p = s.ptr, *end = s.ptr + s.len;
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *stop = comma != NULL ? comma : end;
+        req_slice item;
+        while (p < stop && is_blank(*p)) {
+            p++;
+        }
+        item.ptr = p;
+        item.len = stop - p;
+        while (item.len > 0 && is_blank(item.ptr[item.len - 1])) {
+            item.len--;
+        }
+        if (req_slice_eq(item, token)) {
+            return true;
+        }
+        p = stop + 1;
+    }
+    return false;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file request.h
+ * @brief Single-pass parser for a client's request head
+ *
+ * request_parser_feed() walks the request line and headers once, in place,
+ * and describes them as (pointer, length) slices into the caller's buffer:
+ * nothing is copied, and the buffer is not modified. The slices stay valid
+ * for as long as the buffer does.
+ *
+ * Header names are classified on the way by their length and first
+ * character, so deciding whether a header is one the proxy replaces or a
+ * hop-by-hop header is a switch and at most one comparison rather than a
+ * search through every known name.
+ *
+ * A head may arrive in pieces. A request_parser is fed the bytes received
+ * so far and picks up at the first line it has not seen, the way
+ * parser_parse_line() from http_parser.h is given one line at a time, so a
+ * head that trickles in is still looked at only once. Unlike that parser it
+ * is reset rather than freed between requests: each connection keeps one
+ * for its whole life. The table of headers comes from the connection's
+ * arena, as big as the last request's needed and grown if this one has
+ * more, so a request with a handful of headers does not carry room for
+ * REQUEST_MAX_HEADERS of them.
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "arena.h"
+#include "http_parser.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REQUEST_MAX_HEADERS 100 /* more than this is a 400 */
+#define REQUEST_HOSTLEN 256     /* longest host name, with its NUL */
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} req_slice;
+
+typedef enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_CONNECTION,         /* the hop-by-hop ones from here on */
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_TE,
+    HDR_TRAILER,
+    HDR_TRANSFER_ENCODING,
+    HDR_UPGRADE,
+    HDR_PROXY_AUTHENTICATE,
+    HDR_PROXY_AUTHORIZATION
+} req_header_kind;
+
+/* one header line; offsets are from line so the entry stays small */
+typedef struct {
+    const char *line;    /* start of the line, as received */
+    uint16_t len;        /* the whole line with its line ending */
+    uint16_t name_len;   /* 0 for a line without a colon */
+    uint16_t value_off;  /* the value with surrounding blanks trimmed */
+    uint16_t value_len;
+    uint8_t kind;        /* req_header_kind */
+} req_header;
+
+typedef struct {
+    req_slice method;
+    req_slice uri;
+    req_slice version;
+    req_slice host;      /* from the absolute URI */
+    int port;            /* 80 unless the URI gives one */
+    req_slice path;      /* "/" unless the URI gives one */
+    int nheaders;
+    req_header *headers; /* in the parser's arena */
+} http_request;
+
+/* a request head being parsed as it arrives */
+typedef struct {
+    http_request req;    /* what has been parsed so far */
+    arena *arena;        /* where the header table comes from */
+    int room;            /* headers the table has room for */
+    int expect;          /* headers the last request had */
+    size_t done;         /* bytes fed that have been parsed: whole lines */
+    bool started;        /* the request line is in */
+    bool complete;       /* the blank line is in, done is the head length */
+    parser_state state;  /* after the last line: REQUEST, HEADER or ERROR */
+} request_parser;
+
+/* Set up a parser whose header tables are allocated from a */
+void request_parser_init(request_parser *p, arena *a);
+
+/* Ready p for the next request; the previous one's slices become invalid.
+The arena may be reset before the next call to request_parser_feed(), not
+while a head is half parsed */
+void request_parser_reset(request_parser *p);
+
+/* Parse what has arrived of a head: buf[0..len) is every byte received
+since the reset, the same ones as on the last call plus any new ones. Only
+whole lines not parsed yet are looked at. Returns the length of the head
+up to and including its blank line once that is in, 0 if more is needed, or
+-1 if the head is malformed (or the arena cannot hold its headers) */
+long request_parser_feed(request_parser *p, const char *buf, size_t len);
+
+/* What kind of header a name of len bytes (without the colon) is */
+req_header_kind request_header_kind(const char *name, size_t len);
+
+/* True for the headers that only describe the connection they came on */
+static inline bool request_hop_by_hop(req_header_kind kind)
+{
+    return kind >= HDR_CONNECTION;
+}
+
+static inline req_slice request_header_value(const req_header *h)
+{
+    req_slice s = {h->line + h->value_off, h->value_len};
+    return s;
+}
+
+/* True if s equals the NUL-terminated str, ignoring case */
+bool req_slice_eq(req_slice s, const char *str);
+
+/* True if the comma-separated list in s has token in it, ignoring case */
+bool req_slice_has_token(req_slice s, const char *token);
+
+#endif /* REQUEST_H */
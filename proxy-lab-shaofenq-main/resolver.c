@@ -0,0 +1,394 @@
+/*
+ * resolver.c - name resolution cache and background resolver threads
+ *
+ * Answers live in a hash table keyed by host:port, each with the time it
+ * expires. One mutex covers the table and is never held across a lookup,
+ * so two threads missing on the same name both ask; the second answer
+ * simply replaces the first.
+ *
+ * The background threads take queries from a FIFO, run the same lookup a
+ * worker thread would, and put the finished query on a done list. A byte
+ * written to a non-blocking pipe wakes whoever watches resolver_fd(); if
+ * the pipe is full a wakeup is already pending, which is all it is for.
+ */
+
+#include "cache.h"
+#include "csapp.h"
+#include "resolver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESOLVER_BUCKETS 256
+#define RESOLVER_MAX_ENTRIES 4096 /* cached names, expired ones swept first */
+
+typedef struct dns_entry {
+    char *key; /* host:port */
+    unsigned int hash;
+    int rc;    /* 0, or the error being cached */
+    resolver_result res;
+    unsigned long expires; /* CLOCK_MONOTONIC ms */
+    struct dns_entry *next;
+} dns_entry;
+
+/* a name from the hosts file and the address it stands for */
+typedef struct hosts_entry {
+    char *name;
+    char *addr;
+    struct hosts_entry *next;
+} hosts_entry;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_entry *entries[RESOLVER_BUCKETS];
+static int nentries;
+static unsigned long ttl_ms;
+static hosts_entry *hosts; /* read once by resolver_init(), then immutable */
+
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t query_ready = PTHREAD_COND_INITIALIZER;
+static resolver_query *todo_head, *todo_tail; /* waiting for a thread */
+static resolver_query *done_head, *done_tail; /* waiting for resolver_done() */
+static int notify[2] = {-1, -1};
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int load_hosts(const char *path)
+{
+    char line[MAXLINE];
+    hosts_entry **tail = &hosts;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *p = strchr(line, '#');
+        if (p != NULL) {
+            *p = '\0';
+        }
+        char *addr = strtok(line, " \t\r\n");
+        char *name;
+        while (addr != NULL && (name = strtok(NULL, " \t\r\n")) != NULL) {
+            hosts_entry *h = malloc(sizeof(hosts_entry));
+            if (h == NULL || (h->name = strdup(name)) == NULL
+                || (h->addr = strdup(addr)) == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            h->next = NULL;
+            *tail = h;
+            tail = &h->next;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int resolver_init(int ttl_secs, const char *hosts_file)
+{
+    ttl_ms = (unsigned long)ttl_secs * 1000;
+    if (hosts_file != NULL && load_hosts(hosts_file) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* append the addresses getaddrinfo() gives for name to res */
+static int add_addrs(resolver_result *res, const char *name, const char *port,
+                     int flags)
+{
+    struct addrinfo hints, *listp, *p;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | flags;
+    if ((rc = getaddrinfo(name, port, &hints, &listp)) != 0) {
+        return rc;
+    }
+    for (p = listp; p != NULL && res->count < RESOLVER_MAXADDRS;
+         p = p->ai_next) {
+        resolver_addr *a = &res->addr[res->count];
+        if (p->ai_addrlen > sizeof(a->addr)) {
+            continue;
+        }
+        a->family = p->ai_family;
+        a->socktype = p->ai_socktype;
+        a->protocol = p->ai_protocol;
+        a->addrlen = p->ai_addrlen;
+        memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+        res->count++;
+    }
+    freeaddrinfo(listp);
+    return 0;
+}
+
+/* ask: the hosts file, with every address it lists for host in file
+order, otherwise the system resolver */
+static int resolve(const char *host, const char *port, resolver_result *res)
+{
+    bool listed = false;
+    int rc = 0;
+
+    res->count = 0;
+    for (hosts_entry *h = hosts; h != NULL; h = h->next) {
+        if (!strcasecmp(h->name, host)) {
+            listed = true;
+            add_addrs(res, h->addr, port, AI_NUMERICHOST);
+        }
+    }
+    if (!listed) {
+        rc = add_addrs(res, host, port, AI_ADDRCONFIG);
+    }
+    if (rc == 0 && res->count == 0) {
+        rc = EAI_NONAME;
+    }
+    return rc;
+}
+
+/* an answer worth keeping, and for how long */
+static unsigned long lifetime(int rc)
+{
+    if (rc == 0) {
+        return ttl_ms;
+    }
+    if (rc == EAI_NONAME || rc == EAI_FAIL) {
+        /* the name is not there: asking again right away will not help */
+        unsigned long neg = RESOLVER_NEG_TTL_SECS * 1000UL;
+        return neg < ttl_ms ? neg : ttl_ms;
+    }
+    return 0; /* EAI_AGAIN and the like may work next time */
+}
+
+static bool make_key(char *key, const char *host, const char *port)
+{
+    return snprintf(key, CACHE_KEYLEN, "%s:%s", host, port) < CACHE_KEYLEN;
+}
+
+/* the live entry for key; cache_lock held */
+static dns_entry *find(const char *key, unsigned int hash, unsigned long now)
+{
+    for (dns_entry *e = entries[hash % RESOLVER_BUCKETS]; e != NULL;
+         e = e->next) {
+        if (e->hash == hash && !strcmp(e->key, key)) {
+            return now < e->expires ? e : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* drop the expired entries; cache_lock held */
+static void sweep(unsigned long now)
+{
+    for (int i = 0; i < RESOLVER_BUCKETS; i++) {
+        dns_entry **pp = &entries[i];
+        while (*pp != NULL) {
+            dns_entry *e = *pp;
+            if (now < e->expires) {
+                pp = &e->next;
+                continue;
+            }
+            *pp = e->next;
+            free(e->key);
+            free(e);
+            nentries--;
+        }
+    }
+}
+
+static void store(const char *key, int rc, const resolver_result *res)
+{
+    unsigned long life = lifetime(rc);
+    unsigned int hash = cache_hash(key);
+    unsigned long now;
+    dns_entry *e;
+
+    if (life == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    now = now_ms();
+    for (e = entries[hash % RESOLVER_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && !strcmp(e->key, key)) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        if (nentries >= RESOLVER_MAX_ENTRIES) {
+            sweep(now);
+        }
+        if (nentries >= RESOLVER_MAX_ENTRIES
+            || (e = malloc(sizeof(dns_entry))) == NULL) {
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+        if ((e->key = strdup(key)) == NULL) {
+            free(e);
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+        e->hash = hash;
+        e->next = entries[hash % RESOLVER_BUCKETS];
+        entries[hash % RESOLVER_BUCKETS] = e;
+        nentries++;
+    }
+    e->rc = rc;
+    if (rc == 0) {
+        e->res = *res;
+    }
+    e->expires = now + life;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+bool resolver_cached(const char *host, const char *port, resolver_result *res,
+                     int *rc)
+{
+    char key[CACHE_KEYLEN];
+    dns_entry *e;
+
+    if (ttl_ms == 0 || !make_key(key, host, port)) {
+        return false;
+    }
+    pthread_mutex_lock(&cache_lock);
+    if ((e = find(key, cache_hash(key), now_ms())) != NULL) {
+        *rc = e->rc;
+        if (e->rc == 0) {
+            *res = e->res;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return e != NULL;
+}
+
+int resolver_lookup(const char *host, const char *port, resolver_result *res)
+{
+    char key[CACHE_KEYLEN];
+    int rc;
+
+    if (resolver_cached(host, port, res, &rc)) {
+        return rc;
+    }
+    rc = resolve(host, port, res);
+    if (ttl_ms > 0 && make_key(key, host, port)) {
+        store(key, rc, res);
+    }
+    return rc;
+}
+
+static void *resolver_thread(void *vargp)
+{
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&query_lock);
+        while (todo_head == NULL) {
+            pthread_cond_wait(&query_ready, &query_lock);
+        }
+        resolver_query *q = todo_head;
+        todo_head = q->next;
+        if (todo_head == NULL) {
+            todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&query_lock);
+
+        q->rc = resolver_lookup(q->host, q->port, &q->res);
+
+        q->next = NULL;
+        pthread_mutex_lock(&query_lock);
+        if (done_tail != NULL) {
+            done_tail->next = q;
+        } else {
+            done_head = q;
+        }
+        done_tail = q;
+        pthread_mutex_unlock(&query_lock);
+        char c = 0;
+        if (write(notify[1], &c, 1) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "resolver: notify failed: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+static void start_threads(void)
+{
+    pthread_t tid;
+    if (pipe(notify) < 0) {
+        fprintf(stderr, "resolver: pipe failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(notify[i], F_SETFL, fcntl(notify[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+}
+
+int resolver_fd(void)
+{
+    pthread_once(&threads_once, start_threads);
+    return notify[0];
+}
+
+resolver_query *resolver_submit(const char *host, const char *port, void *arg)
+{
+    resolver_query *q = calloc(1, sizeof(resolver_query));
+    if (q == NULL || strlen(port) >= sizeof(q->port)
+        || (q->host = strdup(host)) == NULL) {
+        free(q);
+        return NULL;
+    }
+    strcpy(q->port, port);
+    q->arg = arg;
+
+    pthread_once(&threads_once, start_threads);
+    pthread_mutex_lock(&query_lock);
+    if (todo_tail != NULL) {
+        todo_tail->next = q;
+    } else {
+        todo_head = q;
+    }
+    todo_tail = q;
+    pthread_cond_signal(&query_ready);
+    pthread_mutex_unlock(&query_lock);
+    return q;
+}
+
+resolver_query *resolver_done(void)
+{
+    char drain[64];
+    resolver_query *q;
+
+    /* empty the pipe first: a query finishing after this still wakes us */
+    while (read(notify[0], drain, sizeof(drain)) > 0) {
+    }
+    pthread_mutex_lock(&query_lock);
+    q = done_head;
+    done_head = done_tail = NULL;
+    pthread_mutex_unlock(&query_lock);
+    return q;
+}
+
+void resolver_cancel(resolver_query *q)
+{
+    q->arg = NULL;
+}
+
+void resolver_query_free(resolver_query *q)
+{
+    free(q->host);
+    free(q);
+}
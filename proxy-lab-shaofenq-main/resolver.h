@@ -0,0 +1,88 @@
+/**
+ * @file resolver.h
+ * @brief Cached name resolution for origin connections
+ *
+ * getaddrinfo() blocks for a whole resolver round trip, and the proxy used
+ * to call it for every origin connection. The resolver keeps the answers
+ * for host:port for a while (-d seconds), failures that will not go away
+ * on their own (no such name) for a shorter while, and serves both from
+ * memory until they expire.
+ *
+ * Worker threads call resolver_lookup() (through conn_connect()) and just
+ * block on a miss. The event loop must not block, so it hands misses to a
+ * few resolver threads with resolver_submit() and learns about finished
+ * ones through a pipe it watches like any other socket.
+ *
+ * Names listed in a hosts file (-H, the /etc/hosts format) are answered
+ * from it without asking the system resolver at all.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdbool.h>
+
+#include <sys/socket.h>
+
+#define RESOLVER_TTL_SECS 60    /* default lifetime of a cached answer */
+#define RESOLVER_NEG_TTL_SECS 5 /* lifetime of a cached "no such name" */
+#define RESOLVER_MAXADDRS 8     /* addresses kept per name, rest dropped */
+#define RESOLVER_THREADS 2      /* threads behind resolver_submit() */
+
+/* one address to try, as getaddrinfo() returned it */
+typedef struct {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} resolver_addr;
+
+typedef struct {
+    int count;
+    resolver_addr addr[RESOLVER_MAXADDRS];
+} resolver_result;
+
+/* Cache answers for ttl_secs seconds, 0 to ask every time; names in
+hosts_file (may be NULL) are answered from it. Call once before the other
+functions; returns -1 if hosts_file cannot be read */
+int resolver_init(int ttl_secs, const char *hosts_file);
+
+/* The addresses of host at the numeric port, from the cache if they are
+there, otherwise by asking and waiting. Returns 0, or the getaddrinfo()
+error (EAI_*) */
+int resolver_lookup(const char *host, const char *port, resolver_result *res);
+
+/* Like resolver_lookup(), but only looks at the cache and never waits:
+false on a miss, otherwise *rc and *res are filled in */
+bool resolver_cached(const char *host, const char *port, resolver_result *res,
+                     int *rc);
+
+/* a lookup run by the resolver threads */
+typedef struct resolver_query {
+    char *host;
+    char port[12];
+    void *arg;          /* the submitter's, NULL once cancelled */
+    int rc;             /* result, as resolver_lookup() returns it */
+    resolver_result res;
+    struct resolver_query *next;
+} resolver_query;
+
+/* Resolve host:port in the background, NULL if out of memory. The query
+comes back from resolver_done() once the answer is in */
+resolver_query *resolver_submit(const char *host, const char *port, void *arg);
+
+/* The descriptor that becomes readable when queries are done */
+int resolver_fd(void);
+
+/* The queries finished since the last call, oldest first, linked through
+next; the caller frees each with resolver_query_free() */
+resolver_query *resolver_done(void);
+
+/* Forget about a submitted query: it still completes, with arg NULL. Only
+the thread that submits and collects queries may call this */
+void resolver_cancel(resolver_query *q);
+
+void resolver_query_free(resolver_query *q);
+
+#endif /* RESOLVER_H */
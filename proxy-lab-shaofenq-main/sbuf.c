@@ -0,0 +1,76 @@
+/*
+ * sbuf.c - bounded FIFO of connected descriptors shared by the acceptor
+ * and the worker threads (the textbook sbuf package, on a mutex and two
+ * condition variables instead of semaphores)
+ */
+
+#include "csapp.h"
+#include "sbuf.h"
+
+#include <pthread.h>
+
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                /* Buffer holds max of n items */
+    sp->front = sp->rear = 0; /* Empty buffer iff front == rear */
+    sp->count = 0;
+    pthread_mutex_init(&sp->mutex, NULL);
+    pthread_cond_init(&sp->not_full, NULL);
+    pthread_cond_init(&sp->not_empty, NULL);
+}
+
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    pthread_mutex_destroy(&sp->mutex);
+    pthread_cond_destroy(&sp->not_full);
+    pthread_cond_destroy(&sp->not_empty);
+}
+
+/* insert item, with the mutex held and a slot known to be free */
+static void sbuf_push(sbuf_t *sp, int item)
+{
+    sp->rear = (sp->rear + 1) % sp->n; /* Insert the item */
+    sp->buf[sp->rear] = item;
+    sp->count++;
+    pthread_cond_signal(&sp->not_empty); /* Announce available item */
+}
+
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == sp->n) { /* Wait for available slot */
+        pthread_cond_wait(&sp->not_full, &sp->mutex);
+    }
+    sbuf_push(sp, item);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+bool sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    bool room;
+
+    pthread_mutex_lock(&sp->mutex);
+    if ((room = sp->count < sp->n)) {
+        sbuf_push(sp, item);
+    }
+    pthread_mutex_unlock(&sp->mutex);
+    return room;
+}
+
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == 0) { /* Wait for available item */
+        pthread_cond_wait(&sp->not_empty, &sp->mutex);
+    }
+    sp->front = (sp->front + 1) % sp->n; /* Remove the item */
+    item = sp->buf[sp->front];
+    sp->count--;
+    pthread_cond_signal(&sp->not_full); /* Announce available slot */
+    pthread_mutex_unlock(&sp->mutex);
+    return item;
+}
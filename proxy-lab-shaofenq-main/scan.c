@@ -0,0 +1,205 @@
+/*
+ * scan.c - SSE2/AVX2 delimiter search with a scalar fallback
+ *
+ * Each vector step loads a block of bytes, compares it against the one or
+ * two bytes searched for, and turns the comparison into a bit mask whose
+ * lowest set bit is the first match. Loads are unaligned and never reach
+ * past end: what is left after the last whole block goes through the byte
+ * loop, so no byte outside [p, end) is ever read.
+ *
+ * The implementation is picked on the first call. Until then the pointer
+ * holds find2_pick(), which asks the CPU, installs the best scanner and
+ * runs it; threads racing through it all install the same one.
+ */
+
+#include "scan.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*find2_fn)(const char *, const char *, char, char);
+
+static const char *find2_scalar(const char *p, const char *end, char a,
+                                char b)
+{
+    while (p < end && *p != a && *p != b) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const char *find2_sse2(const char *p, const char *end, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *find2_avx2(const char *p, const char *end, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    /* the rest in one 16 byte step if it fits, still VEX encoded: handing
+    it to find2_sse2() would mix in legacy SSE code with the upper halves of
+    the registers dirty, which costs more than the whole search */
+    if (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm256_castsi256_si128(va)),
+                         _mm_cmpeq_epi8(v, _mm256_castsi256_si128(vb))));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find2_scalar(p, end, a, b);
+}
+#endif
+
+static const char *find2_pick(const char *p, const char *end, char a, char b);
+
+static find2_fn find2 = find2_pick;
+static const char *impl_name = "scalar";
+
+static const struct {
+    const char *name;
+    find2_fn fn;
+} impls[] = {
+#ifdef SCAN_X86
+    {"avx2", find2_avx2},
+    {"sse2", find2_sse2},
+#endif
+    {"scalar", find2_scalar},
+};
+
+/* __builtin_cpu_supports() is cpuid, plus the XGETBV check that the OS
+saves the AVX registers */
+static bool cpu_has(const char *name)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2")) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (!strcmp(name, "sse2")) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return !strcmp(name, "scalar");
+}
+
+bool scan_use(const char *name)
+{
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!strcmp(impls[i].name, name) && cpu_has(name)) {
+            __atomic_store_n(&impl_name, impls[i].name, __ATOMIC_RELAXED);
+            __atomic_store_n(&find2, impls[i].fn, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *find2_pick(const char *p, const char *end, char a, char b)
+{
+    /* the first one listed that the CPU has; "scalar" always is */
+    for (size_t i = 0; !scan_use(impls[i].name); i++) {
+    }
+    return __atomic_load_n(&find2, __ATOMIC_ACQUIRE)(p, end, a, b);
+}
+
+const char *scan_impl(void)
+{
+    if (__atomic_load_n(&find2, __ATOMIC_ACQUIRE) == find2_pick) {
+        find2_pick(NULL, NULL, 0, 0);
+    }
+    return __atomic_load_n(&impl_name, __ATOMIC_RELAXED);
+}
+
+const char *scan_find(const char *p, const char *end, char c)
+{
+    return __atomic_load_n(&find2, __ATOMIC_ACQUIRE)(p, end, c, c);
+}
+
+const char *scan_find2(const char *p, const char *end, char a, char b)
+{
+    return __atomic_load_n(&find2, __ATOMIC_ACQUIRE)(p, end, a, b);
+}
+
+/* refill an empty rio buffer the way rio_read() does: 1 if there is data,
+0 at EOF, -1 on error */
+static int fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        } else if (rp->rio_cnt == 0) {
+            return 0;
+        } else {
+            rp->rio_bufptr = rp->rio_buf;
+        }
+    }
+    return 1;
+}
+
+ssize_t scan_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    char *out = usrbuf;
+    size_t n = 0;
+
+    while (n + 1 < maxlen) {
+        int rc = fill(rp);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            break; /* EOF: whatever was read is the last line */
+        }
+        size_t avail = (size_t)rp->rio_cnt;
+        if (avail > maxlen - 1 - n) {
+            avail = maxlen - 1 - n;
+        }
+        const char *end = rp->rio_bufptr + avail;
+        const char *lf = scan_find(rp->rio_bufptr, end, '\n');
+        size_t take = lf < end ? (size_t)(lf + 1 - rp->rio_bufptr) : avail;
+        memcpy(out + n, rp->rio_bufptr, take);
+        n += take;
+        rp->rio_bufptr += take;
+        rp->rio_cnt -= take;
+        if (lf < end) {
+            break;
+        }
+    }
+    if (maxlen > 0) {
+        out[n] = '\0';
+    }
+    return (ssize_t)n;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file scan.h
+ * @brief Finding the bytes that delimit a request head, many at a time
+ *
+ * Splitting a head into lines, a line into words and a header into name
+ * and value all come down to finding the next '\n', ' ' or ':'. The
+ * scanners here compare 32 bytes per step with AVX2 or 16 with SSE2,
+ * whichever the CPU has (asked with cpuid on first use), and fall back to
+ * a plain byte loop on anything else.
+ *
+ * scan_readlineb() is rio_readlineb() built on them: it finds the end of
+ * the line in the rio buffer and copies the line out in one go instead of
+ * one byte per call, and can be mixed with the other rio calls on the
+ * same rio_t.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "csapp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The first byte in [p, end) that is c, or end if there is none */
+const char *scan_find(const char *p, const char *end, char c);
+
+/* The first byte in [p, end) that is a or b, or end if there is none */
+const char *scan_find2(const char *p, const char *end, char a, char b);
+
+/* rio_readlineb(), with the same results */
+ssize_t scan_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+
+/* The scanner in use: "avx2", "sse2" or "scalar" */
+const char *scan_impl(void);
+
+/* Use the named scanner from now on, for benchmarks; false if this CPU
+does not have it */
+bool scan_use(const char *name);
+
+#endif /* SCAN_H */
@@ -0,0 +1,269 @@
+/*
+ * stats.c - per-thread counters and latency histograms, and their report
+ *
+ * A thread's slot is picked the first time it counts and kept in a thread-
+ * local pointer; slots are handed out round robin, so with more than
+ * STATS_SLOTS threads (one per connection with -w 0) some share one, which
+ * the atomic adds keep correct. Nothing is ever reset: a report sums every
+ * slot as it reads it, with relaxed loads, so it may be a few requests
+ * behind the threads still counting, but never needs a lock.
+ */
+
+#include "arena.h"
+#include "cache.h"
+#include "csapp.h"
+#include "refresh.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define CACHE_LINE 64
+
+typedef struct {
+    unsigned long counters[STAT_COUNTERS];
+    unsigned long hist[STAT_HISTS][STATS_BUCKETS];
+    unsigned long sum_us[STAT_HISTS];
+} __attribute__((aligned(CACHE_LINE))) stats_slot;
+
+static stats_slot slots[STATS_SLOTS];
+static unsigned int slots_taken;
+static __thread stats_slot *mine;
+static unsigned long started; /* CLOCK_MONOTONIC ns at stats_init() */
+static int dump_every;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static stats_slot *my_slot(void)
+{
+    if (mine == NULL) {
+        unsigned int i = __atomic_fetch_add(&slots_taken, 1, __ATOMIC_RELAXED);
+        mine = &slots[i % STATS_SLOTS];
+    }
+    return mine;
+}
+
+/* the bucket of a value in microseconds: values below STATS_SUB have one
+each, then every power of two gets STATS_SUB buckets */
+static int bucket_of(unsigned long us)
+{
+    if (us < STATS_SUB) {
+        return us;
+    }
+    int shift = 63 - __builtin_clzl(us) - STATS_SUB_BITS;
+    int i = (shift + 1) * STATS_SUB + (int)((us >> shift) - STATS_SUB);
+    return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+/* the highest value bucket i holds */
+static unsigned long bucket_top(int i)
+{
+    if (i < STATS_SUB) {
+        return i;
+    }
+    int shift = i / STATS_SUB - 1;
+    return (((unsigned long)(STATS_SUB + i % STATS_SUB) + 1) << shift) - 1;
+}
+
+void stats_count(stat_counter c, unsigned long n)
+{
+    __atomic_add_fetch(&my_slot()->counters[c], n, __ATOMIC_RELAXED);
+}
+
+void stats_time(stat_hist h, unsigned long ns)
+{
+    stats_slot *s = my_slot();
+    unsigned long us = ns / 1000;
+
+    __atomic_add_fetch(&s->hist[h][bucket_of(us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->sum_us[h], us, __ATOMIC_RELAXED);
+}
+
+static unsigned long counter(stat_counter c)
+{
+    unsigned long n = 0;
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        n += __atomic_load_n(&slots[i].counters[c], __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/* appends to a report, dropping what does not fit */
+typedef struct {
+    char *buf;
+    size_t size, len;
+} report;
+
+static void put(report *r, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (r->len >= r->size) {
+        return;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(r->buf + r->len, r->size - r->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        r->len += (size_t)n < r->size - r->len ? (size_t)n : r->size - r->len - 1;
+    }
+}
+
+/* a histogram's count, mean and percentiles, as the top of the bucket
+each falls into */
+static void put_hist(report *r, const char *name, stat_hist h)
+{
+    static const struct {
+        const char *name;
+        double q;
+    } quantiles[] = {{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}};
+    unsigned long counts[STATS_BUCKETS], total = 0, sum = 0;
+    int top = 0;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        counts[b] = 0;
+        for (int i = 0; i < STATS_SLOTS; i++) {
+            counts[b] += __atomic_load_n(&slots[i].hist[h][b], __ATOMIC_RELAXED);
+        }
+        total += counts[b];
+        if (counts[b] > 0) {
+            top = b;
+        }
+    }
+    for (int i = 0; i < STATS_SLOTS; i++) {
+        sum += __atomic_load_n(&slots[i].sum_us[h], __ATOMIC_RELAXED);
+    }
+    put(r, "%s_count %lu\n%s_mean %lu\n", name, total, name,
+        total > 0 ? sum / total : 0);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        double at = quantiles[q].q * total;
+        unsigned long rank = (unsigned long)at, seen = 0;
+        int b = 0;
+        if (rank < at || rank == 0) {
+            rank++; /* the rank-th smallest value, counting from 1 */
+        }
+        while (b < top && seen + counts[b] < rank) {
+            seen += counts[b++];
+        }
+        put(r, "%s_%s %lu\n", name, quantiles[q].name, total > 0 ? bucket_top(b) : 0);
+    }
+    put(r, "%s_max %lu\n", name, total > 0 ? bucket_top(top) : 0);
+}
+
+size_t stats_report(char *buf, size_t size)
+{
+    report r = {buf, size, 0};
+    unsigned long opened = counter(STAT_CLIENTS_OPENED);
+    unsigned long closed = counter(STAT_CLIENTS_CLOSED);
+    cache_stats cs;
+    refresh_counts rc;
+    arena_stats as;
+
+    if (size == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+    put(&r, "uptime_s %lu\n", (now_ns() - started) / 1000000000ul);
+    put(&r, "requests %lu\n", counter(STAT_REQUESTS));
+    put(&r, "hits %lu\n", counter(STAT_HITS));
+    put(&r, "misses %lu\n", counter(STAT_MISSES));
+    put(&r, "not_modified %lu\n", counter(STAT_NOT_MODIFIED));
+    put(&r, "bytes_sent %lu\n", counter(STAT_BYTES_SENT));
+    put(&r, "bytes_copied %lu\n", counter(STAT_BYTES_COPIED));
+    put(&r, "origin_connects %lu\n", counter(STAT_CONNECTS));
+    put(&r, "connections_total %lu\n", opened);
+    put(&r, "connections_active %lu\n", opened > closed ? opened - closed : 0);
+    put_hist(&r, "ttfb_us", STAT_TTFB);
+    put_hist(&r, "total_us", STAT_TOTAL);
+    put_hist(&r, "connect_us", STAT_CONNECT);
+
+    cache_stats_read(&cs);
+    put(&r, "cache_policy %s\n", cs.policy);
+    put(&r, "cache_bytes %zu\n", cs.used);
+    put(&r, "cache_objects %lu\n", cs.objects);
+    put(&r, "cache_evictions %lu\n", cs.evictions);
+    put(&r, "cache_revalidated %lu\n", cs.revalidated);
+    put(&r, "cache_revalidated_bytes %lu\n", cs.saved);
+    if (cs.tinylfu) {
+        put(&r, "tinylfu_admitted %lu\n", cs.admitted);
+        put(&r, "tinylfu_rejected %lu\n", cs.rejected);
+        put(&r, "tinylfu_sketched %lu\n", cs.sketched);
+        put(&r, "tinylfu_agings %lu\n", cs.agings);
+    }
+    refresh_stats(&rc);
+    put(&r, "refresh_queued %lu\n", rc.queued);
+    put(&r, "refresh_refreshed %lu\n", rc.refreshed);
+    put(&r, "refresh_replaced %lu\n", rc.replaced);
+    put(&r, "refresh_failed %lu\n", rc.failed);
+    arena_stats_read(&as);
+    put(&r, "arena_high %zu\n", as.high);
+    put(&r, "arena_hint %zu\n", as.hint);
+    put(&r, "arena_reserved %zu\n", as.reserved);
+    put(&r, "arena_chunks %lu\n", as.chunks);
+    return r.len;
+}
+
+size_t stats_response(char *buf, size_t size)
+{
+    char body[STATS_REPORT_MAX];
+    size_t bodylen = stats_report(body, sizeof(body));
+    int headlen = snprintf(buf, size,
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "Cache-Control: no-store\r\n"
+                           "Content-Length: %zu\r\n\r\n", bodylen);
+
+    if (headlen < 0 || (size_t)headlen >= size) {
+        return 0;
+    }
+    if (bodylen > size - headlen) {
+        bodylen = size - headlen;
+    }
+    memcpy(buf + headlen, body, bodylen);
+    return headlen + bodylen;
+}
+
+void stats_send(int fd)
+{
+    char buf[STATS_RESPONSE_MAX];
+    size_t len = stats_response(buf, sizeof(buf));
+
+    if (rio_writen(fd, buf, len) < 0) {
+        fprintf(stderr, "Error writing stats to client\n");
+    }
+}
+
+static void *dump_thread(void *vargp)
+{
+    char buf[STATS_REPORT_MAX];
+
+    pthread_detach(pthread_self());
+    while (1) {
+        sleep(dump_every);
+        stats_report(buf, sizeof(buf));
+        fprintf(stderr, "-- %s\n%s", STATS_PATH + 1, buf);
+    }
+    return NULL;
+}
+
+void stats_init(int dump_secs)
+{
+    pthread_t tid;
+
+    started = now_ns();
+    dump_every = dump_secs;
+    if (dump_secs > 0) {
+        pthread_create(&tid, NULL, dump_thread, NULL);
+    }
+}
@@ -0,0 +1,76 @@
+/**
+ * @file stats.h
+ * @brief Request counters and latency histograms, served at /proxy-stats
+ *
+ * Every thread that counts gets a slot of its own, aligned to a cache line,
+ * and adds to it with relaxed atomic adds: no two threads write the same
+ * line unless there are more than STATS_SLOTS of them, so counting adds no
+ * contention to the request path. A report sums the slots as it reads them.
+ *
+ * Latencies go into log-linear histograms in the style of HdrHistogram:
+ * each power of two of microseconds is split into 2^STATS_SUB_BITS equal
+ * buckets, so a value is kept to within 1/2^STATS_SUB_BITS of itself from a
+ * microsecond up to hours, in a fixed STATS_BUCKETS counters, and
+ * percentiles are read off the summed buckets.
+ *
+ * The report is plain text, one "name value" per line. The proxy answers
+ * it itself when asked for STATS_PATH directly (not through it, as in
+ * "GET /proxy-stats"), and with -m writes it to stderr periodically.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define STATS_PATH "/proxy-stats"
+#define STATS_SLOTS 64     /* threads counted apart; more share slots */
+#define STATS_SUB_BITS 3   /* buckets per power of two: 2^this */
+#define STATS_BUCKETS 256  /* up to 2^34 us, over 4 hours */
+#define STATS_REPORT_MAX 8192 /* the longest report */
+#define STATS_RESPONSE_MAX (STATS_REPORT_MAX + 128) /* with its head */
+
+typedef enum {
+    STAT_REQUESTS,       /* requests answered, from the cache or an origin */
+    STAT_HITS,           /* served from the cache, stale ones included */
+    STAT_MISSES,         /* fetched from the origin */
+    STAT_NOT_MODIFIED,   /* stale hits an origin's 304 let us serve */
+    STAT_BYTES_SENT,     /* response bytes written to clients */
+    STAT_BYTES_COPIED,   /* copied in user space, see relay_stats.copied */
+    STAT_CONNECTS,       /* new origin connections */
+    STAT_CLIENTS_OPENED, /* client connections accepted */
+    STAT_CLIENTS_CLOSED,
+    STAT_COUNTERS
+} stat_counter;
+
+typedef enum {
+    STAT_TTFB,    /* request read to first response byte sent */
+    STAT_TOTAL,   /* request read to last response byte sent */
+    STAT_CONNECT, /* opening new origin connections, the lookup included */
+    STAT_HISTS
+} stat_hist;
+
+/* Start writing the report to stderr every dump_secs seconds, 0 for never */
+void stats_init(int dump_secs);
+
+/* Add n to counter c */
+void stats_count(stat_counter c, unsigned long n);
+
+/* Record a latency of ns nanoseconds in histogram h */
+void stats_time(stat_hist h, unsigned long ns);
+
+/* Write the report to buf, at most size bytes with the NUL; returns its
+length */
+size_t stats_report(char *buf, size_t size);
+
+/* Write the whole response to a request for STATS_PATH, head and report,
+to buf, at most size bytes; returns its length. The connection is to be
+closed after it */
+size_t stats_response(char *buf, size_t size);
+
+/* Answer a request for STATS_PATH on the blocking socket fd with
+stats_response(), then the connection is to be closed */
+void stats_send(int fd);
+
+#endif /* STATS_H */
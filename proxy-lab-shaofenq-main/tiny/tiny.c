@@ -7,6 +7,7 @@
  */
 
 #include "csapp.h"
+#include "scan.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -290,11 +291,10 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
  */
 bool read_requesthdrs(client_info *client, rio_t *rp) {
     char buf[MAXLINE];
-    char name[MAXLINE];
-    char value[MAXLINE];
 
     while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+        ssize_t n = scan_readlineb(rp, buf, sizeof(buf));
+        if (n <= 0) {
             return true;
         }
 
@@ -303,13 +303,26 @@ bool read_requesthdrs(client_info *client, rio_t *rp) {
             return false;
         }
 
-        /* Parse header into name and value */
-        if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
+        /* Parse header into name and value, in place: the name is
+         * everything before the colon, the value the rest of the line
+         * after any whitespace */
+        char *end = buf + n;
+        char *name = buf;
+        char *colon = (char *) scan_find(buf, end, ':');
+        char *value = colon + 1;
+        while (value < end && isspace((unsigned char) *value)) {
+            value++;
+        }
+        char *value_end = colon < end ? (char *) scan_find2(value, end, '\r', '\n')
+                                      : end;
+        if (colon == buf || colon == end || value_end == value) {
             /* Error parsing header */
             clienterror(client->connfd, "400", "Bad Request",
                         "Tiny could not parse request headers");
             return true;
         }
+        *colon = '\0';
+        *value_end = '\0';
 
         /* Convert name to lowercase */
         for (size_t i = 0; name[i] != '\0'; i++) {
@@ -343,7 +356,7 @@ void serve(client_info *client) {
 
     /* Read request line */
     char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
+    if (scan_readlineb(&rio, buf, sizeof(buf)) <= 0) {
         return;
     }
 
@@ -0,0 +1,360 @@
+/*
+ * upstream.c - pool of idle keep-alive origin connections, and the response
+ * framing that tells when a connection is free to be reused
+ *
+ * The pool is a small hash table of origins (host:port); each origin keeps
+ * its idle sockets on a list, most recently parked first, so the warmest
+ * connection is handed out next and the oldest ones expire from the tail.
+ * One mutex covers the table: it is only held to move a descriptor in or
+ * out, never across a system call that waits.
+ */
+
+#include "cache.h"
+#include "csapp.h"
+#include "upstream.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#define UPSTREAM_BUCKETS 64
+
+typedef struct idle_conn {
+    int fd;
+    unsigned long since; /* CLOCK_MONOTONIC ms when it was parked */
+    struct idle_conn *next;
+} idle_conn;
+
+typedef struct upstream_host {
+    char *key; /* host:port */
+    unsigned int hash;
+    int nidle;
+    idle_conn *idle; /* newest first */
+    struct upstream_host *next;
+} upstream_host;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static upstream_host *hosts[UPSTREAM_BUCKETS];
+static int max_idle;
+static unsigned long idle_ms;
+static unsigned long last_sweep;
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void upstream_init(int max_per_host, int idle_secs)
+{
+    max_idle = max_per_host;
+    idle_ms = (unsigned long)idle_secs * 1000;
+    last_sweep = now_ms();
+}
+
+/* the origin's entry, created if create is set; called with pool_lock held */
+static upstream_host *find_host(const char *host, const char *port,
+                                bool create)
+{
+    char key[CACHE_KEYLEN];
+    if (snprintf(key, sizeof(key), "%s:%s", host, port) >= (int)sizeof(key)) {
+        return NULL;
+    }
+    unsigned int hash = cache_hash(key);
+    upstream_host *h;
+    for (h = hosts[hash % UPSTREAM_BUCKETS]; h != NULL; h = h->next) {
+        if (h->hash == hash && !strcmp(h->key, key)) {
+            return h;
+        }
+    }
+    if (!create || (h = calloc(1, sizeof(upstream_host))) == NULL) {
+        return NULL;
+    }
+    if ((h->key = strdup(key)) == NULL) {
+        free(h);
+        return NULL;
+    }
+    h->hash = hash;
+    h->next = hosts[hash % UPSTREAM_BUCKETS];
+    hosts[hash % UPSTREAM_BUCKETS] = h;
+    return h;
+}
+
+/* close the connections of h that have been idle too long; pool_lock held */
+static void expire(upstream_host *h, unsigned long now)
+{
+    idle_conn **pp = &h->idle;
+    while (*pp != NULL && now - (*pp)->since < idle_ms) {
+        pp = &(*pp)->next;
+    }
+    /* the list is sorted by age, so everything from here on is stale */
+    while (*pp != NULL) {
+        idle_conn *ic = *pp;
+        *pp = ic->next;
+        close(ic->fd);
+        free(ic);
+        h->nidle--;
+    }
+}
+
+/* every idle period, expire the origins nobody asked for lately too */
+static void sweep(unsigned long now)
+{
+    if (now - last_sweep < idle_ms) {
+        return;
+    }
+    last_sweep = now;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        for (upstream_host *h = hosts[i]; h != NULL; h = h->next) {
+            expire(h, now);
+        }
+    }
+}
+
+/* an idle socket is only usable if the origin has neither closed it nor
+sent anything on it since the last response */
+static bool still_open(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_take(const char *host, const char *port)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    unsigned long now = now_ms();
+    sweep(now);
+    upstream_host *h = find_host(host, port, false);
+    if (h != NULL) {
+        expire(h, now);
+        while (fd < 0 && h->idle != NULL) {
+            idle_conn *ic = h->idle;
+            h->idle = ic->next;
+            h->nidle--;
+            if (still_open(ic->fd)) {
+                fd = ic->fd;
+            } else {
+                close(ic->fd);
+            }
+            free(ic);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return fd;
+}
+
+void upstream_put(const char *host, const char *port, int fd)
+{
+    idle_conn *ic = malloc(sizeof(idle_conn));
+
+    pthread_mutex_lock(&pool_lock);
+    unsigned long now = now_ms();
+    sweep(now);
+    upstream_host *h = find_host(host, port, true);
+    if (ic != NULL && h != NULL && h->nidle < max_idle) {
+        ic->fd = fd;
+        ic->since = now;
+        ic->next = h->idle;
+        h->idle = ic;
+        h->nidle++;
+        ic = NULL;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(ic);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void upstream_framing_init(upstream_framing *f)
+{
+    f->state = UPSTREAM_HEAD;
+    f->status = 0;
+    f->keepalive = false;
+    f->chunked = false;
+    f->length = -1;
+    f->left = 0;
+    f->head_len = 0;
+    f->linelen = 0;
+}
+
+static void lowercase(char *s)
+{
+    for (; *s; s++) {
+        *s = tolower((unsigned char)*s);
+    }
+}
+
+/* the blank line after the headers: decide how the body is framed */
+static void end_of_head(upstream_framing *f)
+{
+    if (f->status >= 100 && f->status < 200) {
+        /* interim response: the real one follows on the same connection */
+        f->status = 0;
+        f->chunked = false;
+        f->length = -1;
+    } else if (f->status == 204 || f->status == 304) {
+        f->state = UPSTREAM_DONE;
+    } else if (f->chunked) {
+        f->state = UPSTREAM_CHUNK_SIZE;
+    } else if (f->length >= 0) {
+        f->left = f->length;
+        f->state = f->left > 0 ? UPSTREAM_BODY : UPSTREAM_DONE;
+    } else {
+        f->keepalive = false;
+        f->state = UPSTREAM_UNTIL_CLOSE;
+    }
+}
+
+static void head_line(upstream_framing *f, char *line)
+{
+    int minor;
+
+    if (f->status == 0) {
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &f->status) != 2) {
+            /* not something we can frame: relay it until the origin closes */
+            f->keepalive = false;
+            f->state = UPSTREAM_UNTIL_CLOSE;
+            return;
+        }
+        f->keepalive = minor >= 1; /* 1.0 must ask for keep-alive itself */
+        return;
+    }
+    if (line[0] == '\0') {
+        end_of_head(f);
+        return;
+    }
+
+    char *value = strchr(line, ':');
+    if (value == NULL) {
+        return;
+    }
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    lowercase(value);
+    if (!strcasecmp(line, "Content-Length")) {
+        f->length = strtoll(value, NULL, 10);
+    } else if (!strcasecmp(line, "Transfer-Encoding")) {
+        f->chunked = strstr(value, "chunked") != NULL;
+    } else if (!strcasecmp(line, "Connection")) {
+        if (strstr(value, "close") != NULL) {
+            f->keepalive = false;
+        } else if (strstr(value, "keep-alive") != NULL) {
+            f->keepalive = true;
+        }
+    }
+}
+
+/* one complete line (CRLF stripped) outside the body */
+static void line_done(upstream_framing *f, char *line)
+{
+    char *end;
+    unsigned long long size;
+
+    switch (f->state) {
+    case UPSTREAM_HEAD:
+        head_line(f, line);
+        break;
+    case UPSTREAM_CHUNK_SIZE:
+        size = strtoull(line, &end, 16);
+        if (end == line) {
+            f->keepalive = false;
+            f->state = UPSTREAM_UNTIL_CLOSE;
+        } else if (size == 0) {
+            f->state = UPSTREAM_TRAILER;
+        } else {
+            f->left = size;
+            f->state = UPSTREAM_CHUNK_DATA;
+        }
+        break;
+    case UPSTREAM_CHUNK_END:
+        f->state = UPSTREAM_CHUNK_SIZE;
+        break;
+    case UPSTREAM_TRAILER:
+        if (line[0] == '\0') {
+            f->state = UPSTREAM_DONE;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+size_t upstream_frame(upstream_framing *f, const char *data, size_t n)
+{
+    size_t used = 0, k;
+
+    while (used < n && f->state != UPSTREAM_DONE) {
+        switch (f->state) {
+        case UPSTREAM_BODY:
+        case UPSTREAM_CHUNK_DATA:
+            k = n - used < f->left ? n - used : f->left;
+            f->left -= k;
+            used += k;
+            if (f->left == 0) {
+                f->state = f->state == UPSTREAM_BODY ? UPSTREAM_DONE
+                                                     : UPSTREAM_CHUNK_END;
+            }
+            break;
+        case UPSTREAM_UNTIL_CLOSE:
+            used = n;
+            break;
+        default:
+            /* headers and chunk framing are taken a line at a time; only
+            the start of an overlong line is kept, which is all we read */
+            if (f->state == UPSTREAM_HEAD) {
+                f->head_len++;
+            }
+            if (data[used] == '\n') {
+                if (f->linelen > 0 && f->line[f->linelen - 1] == '\r') {
+                    f->linelen--;
+                }
+                f->line[f->linelen] = '\0';
+                f->linelen = 0;
+                line_done(f, f->line);
+            } else if (f->linelen < UPSTREAM_LINELEN - 1) {
+                f->line[f->linelen++] = data[used];
+            }
+            used++;
+            break;
+        }
+    }
+    return used;
+}
+
+size_t upstream_body_left(const upstream_framing *f)
+{
+    if (f->state == UPSTREAM_BODY) {
+        return f->left;
+    }
+    return f->state == UPSTREAM_UNTIL_CLOSE ? SIZE_MAX : 0;
+}
+
+bool upstream_frame_eof(upstream_framing *f)
+{
+    if (f->state == UPSTREAM_UNTIL_CLOSE) {
+        f->state = UPSTREAM_DONE;
+    }
+    return f->state == UPSTREAM_DONE;
+}
+
+bool upstream_frame_done(const upstream_framing *f)
+{
+    return f->state == UPSTREAM_DONE;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file upstream.h
+ * @brief Idle keep-alive connections to origin servers, and response framing
+ *
+ * With -k the proxy asks origins to keep the connection open and, once a
+ * response has been relayed completely, parks the socket in a pool keyed by
+ * host:port instead of closing it. The next request for the same origin
+ * takes it from there and skips the DNS lookup and TCP handshake.
+ *
+ * A connection can only be reused if we know exactly where the response on
+ * it ends, so the relay feeds every response through an upstream_framing:
+ * it reads the status line and headers and then follows Content-Length or
+ * the chunked encoding. A response framed only by the origin closing the
+ * connection is relayed as before and the socket is not pooled.
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define UPSTREAM_IDLE_SECS 5 /* default idle timeout of a pooled connection */
+#define UPSTREAM_LINELEN 256 /* longest header line looked at, rest ignored */
+
+/* Keep at most max_per_host idle connections per origin, each for at most
+idle_secs seconds; call once before the other functions */
+void upstream_init(int max_per_host, int idle_secs);
+
+/* An idle connection to host:port that still looks alive, or -1 if the pool
+has none. The caller owns the descriptor from then on */
+int upstream_take(const char *host, const char *port);
+
+/* Park fd, which just finished a complete response, for reuse; it is closed
+instead if host:port already has max_per_host idle connections */
+void upstream_put(const char *host, const char *port, int fd);
+
+typedef enum {
+    UPSTREAM_HEAD,        /* status line and headers */
+    UPSTREAM_BODY,        /* left bytes of a Content-Length body */
+    UPSTREAM_UNTIL_CLOSE, /* no length given: the body ends at EOF */
+    UPSTREAM_CHUNK_SIZE,  /* chunk size line */
+    UPSTREAM_CHUNK_DATA,  /* left bytes of the current chunk */
+    UPSTREAM_CHUNK_END,   /* CRLF after a chunk's data */
+    UPSTREAM_TRAILER,     /* trailer lines after the last chunk */
+    UPSTREAM_DONE
+} upstream_state;
+
+/* where we are in one response from an origin */
+typedef struct {
+    upstream_state state;
+    int status;         /* status code, 0 until the status line is read */
+    bool keepalive;     /* the origin lets us send another request */
+    bool chunked;
+    long long length;   /* Content-Length, -1 if not given */
+    size_t left;        /* bytes left in the body or the current chunk */
+    size_t head_len;    /* bytes of status line and headers seen so far */
+    size_t linelen;
+    char line[UPSTREAM_LINELEN];
+} upstream_framing;
+
+/* Start following a new response */
+void upstream_framing_init(upstream_framing *f);
+
+/* Account for the next n response bytes and return how many of them belong
+to this response; that is n unless the response ends inside data. In
+upstream_body_left() bytes the data is only counted, not looked at, so it
+may be NULL there (bytes moved with splice()) */
+size_t upstream_frame(upstream_framing *f, const char *data, size_t n);
+
+/* How many of the next bytes are plain body that need not be inspected:
+the rest of a Content-Length body, SIZE_MAX for a body that runs until the
+connection closes, and 0 while headers or chunk framing are next */
+size_t upstream_body_left(const upstream_framing *f);
+
+/* The origin closed the connection: true if that properly ends the
+response, as it does for one without a length, false if it was cut short */
+bool upstream_frame_eof(upstream_framing *f);
+
+/* True once the whole response has been seen */
+bool upstream_frame_done(const upstream_framing *f);
+
+#endif /* UPSTREAM_H */